@@ -0,0 +1,259 @@
+/*
+Copyright (c) 2022 Niclas Rosenvik
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "audit.hpp"
+
+#include "config.hpp"
+#include "functions.hpp"
+#include "hashlib2botan.hpp"
+#include "record.hpp"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <botan/base64.h>
+#include <botan/hash.h>
+#include <pystring.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace crosswrench {
+
+namespace {
+// the files are hashed in batches of this many, the batches are spread
+// over the threads of runparallel
+const std::size_t AUDITBATCHSIZE = 256;
+
+// the name given to --audit to check every installed distribution
+const std::string AUDITALL = "*";
+} // namespace
+
+audit::audit(std::string _name)
+  : name{ _name }
+  , destdir{ config::instance()->get_value("destdir") }
+  , verbose{ config::instance()->get_value("verbose") == "true" }
+{}
+
+// true when every file in the RECORD files matches its hash and size
+bool
+audit::check()
+{
+    auto dirs = distinfodirs();
+    if (dirs.empty()) {
+        std::string msg{ "crosswrench audit: " };
+        msg += name == AUDITALL ? "no distributions are installed"
+                                : name + " is not installed";
+        throw msg;
+    }
+
+    bool recordsvalid = true;
+    for (auto &dir : dirs) {
+        if (!addrecordfiles(dir)) {
+            recordsvalid = false;
+        }
+    }
+
+    std::cout << "Auditing " << files.size() << " files of " << dirs.size()
+              << " distributions" << std::endl;
+    hashfiles();
+
+    std::size_t missing = 0;
+    std::size_t sizes = 0;
+    std::size_t modified = 0;
+    std::size_t unreadable = 0;
+    for (std::size_t i = 0; i < files.size(); i++) {
+        auto filepath = files[i].filepath.string();
+        switch (results[i]) {
+            case AUDITOK:
+                if (verbose) {
+                    std::cout << filepath << " ok" << std::endl;
+                }
+                break;
+            case AUDITMISSING:
+                std::cout << filepath << " is missing" << std::endl;
+                missing++;
+                break;
+            case AUDITSIZE:
+                std::cout << filepath << " does not have the size "
+                          << files[i].filesize << " in RECORD" << std::endl;
+                sizes++;
+                break;
+            case AUDITMODIFIED:
+                std::cout << filepath << " does not match its hash in RECORD"
+                          << std::endl;
+                modified++;
+                break;
+            case AUDITUNREADABLE:
+                std::cout << filepath << " could not be read" << std::endl;
+                unreadable++;
+                break;
+        }
+    }
+
+    std::cout << missing << " missing, " << sizes << " size mismatched, "
+              << modified << " modified and " << unreadable
+              << " unreadable files" << std::endl;
+
+    return recordsvalid && missing + sizes + modified + unreadable == 0;
+}
+
+// the .dist-info directories in purelib and platlib
+std::vector<boost::filesystem::path>
+audit::distinfodirs()
+{
+    std::set<boost::filesystem::path> roots{
+        (destdir / rootinstalldir(true)).lexically_normal(),
+        (destdir / rootinstalldir(false)).lexically_normal()
+    };
+    std::set<boost::filesystem::path> dirs;
+
+    for (auto &root : roots) {
+        if (name != AUDITALL) {
+            auto distinfo = installeddistinfo(root, name);
+            if (!distinfo.empty()) {
+                dirs.insert(distinfo);
+            }
+            continue;
+        }
+
+        boost::system::error_code ec;
+        for (boost::filesystem::directory_iterator i{ root, ec }, end;
+             !ec && i != end;
+             i.increment(ec))
+        {
+            if (pystring::endswith(i->path().filename().string(),
+                                   ".dist-info") &&
+                boost::filesystem::is_directory(i->path()))
+            {
+                dirs.insert(i->path());
+            }
+        }
+    }
+
+    return std::vector<boost::filesystem::path>{ dirs.begin(), dirs.end() };
+}
+
+// rows without a hash, like the one for RECORD, are not audited
+bool
+audit::addrecordfiles(boost::filesystem::path distinfo)
+{
+    auto recordpath = distinfo / "RECORD";
+    if (!boost::filesystem::is_regular_file(recordpath)) {
+        std::cout << recordpath.string() << " is missing" << std::endl;
+        return false;
+    }
+
+    boost::filesystem::ifstream input_p{ recordpath, std::ios_base::binary };
+    std::stringstream content;
+    content << input_p.rdbuf();
+
+    try {
+        record installedrecord{ content.str(), true };
+        auto root = distinfo.parent_path();
+        for (auto &f : installedrecord.files()) {
+            if (installedrecord.hashtype(f).empty()) {
+                continue;
+            }
+            files.push_back({ (root / f).lexically_normal(),
+                              h2b.hashname(installedrecord.hashtype(f)),
+                              installedrecord.hash(f),
+                              installedrecord.filesize(f) });
+        }
+    }
+    catch (std::string s) {
+        std::cout << recordpath.string() << ": " << s << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// every thread keeps one hash function per algorithm for a whole batch
+void
+audit::hashfiles()
+{
+    auto batches = (files.size() + AUDITBATCHSIZE - 1) / AUDITBATCHSIZE;
+    results.assign(files.size(), AUDITOK);
+
+    runparallel(batches, [&](std::size_t batch) {
+        std::map<std::string, std::unique_ptr<Botan::HashFunction>> hashers;
+        auto first = batch * AUDITBATCHSIZE;
+        auto last = std::min(first + AUDITBATCHSIZE, files.size());
+        for (auto i = first; i < last; i++) {
+            results[i] = hashfile(files[i], hashers);
+        }
+    });
+}
+
+// the size is compared before the mapped file is hashed
+audit::auditresult
+audit::hashfile(
+  auditfile &file,
+  std::map<std::string, std::unique_ptr<Botan::HashFunction>> &hashers)
+{
+    boost::system::error_code ec;
+    auto status = boost::filesystem::status(file.filepath, ec);
+    if (!boost::filesystem::exists(status)) {
+        return AUDITMISSING;
+    }
+    if (!boost::filesystem::is_regular_file(status)) {
+        return AUDITMODIFIED;
+    }
+
+    auto &hasher = hashers[file.hashtype];
+    if (!hasher) {
+        hasher = Botan::HashFunction::create(file.hashtype);
+    }
+
+    bool sizematches = true;
+    auto hashdata = [&](const std::uint8_t *data, std::size_t data_size) {
+        if (!file.filesize.empty() &&
+            std::to_string(data_size) != file.filesize)
+        {
+            sizematches = false;
+            return;
+        }
+        hasher->update(data, data_size);
+    };
+
+    if (!readfile(file.filepath, hashdata)) {
+        return AUDITUNREADABLE;
+    }
+    auto hash = base64urlsafenopad(Botan::base64_encode(hasher->final()));
+    if (!sizematches) {
+        return AUDITSIZE;
+    }
+    if (hash != file.hash) {
+        return AUDITMODIFIED;
+    }
+
+    return AUDITOK;
+}
+
+} // namespace crosswrench
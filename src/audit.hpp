@@ -0,0 +1,57 @@
+#if !defined(_SRC_AUDIT_HPP_)
+#define _SRC_AUDIT_HPP_
+
+#include "hashlib2botan.hpp"
+
+#include <boost/filesystem.hpp>
+#include <botan/hash.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace crosswrench {
+
+class audit
+{
+  public:
+    audit(std::string);
+    bool check();
+
+  private:
+    struct auditfile
+    {
+        boost::filesystem::path filepath;
+        std::string hashtype;
+        std::string hash;
+        std::string filesize;
+    };
+
+    enum auditresult : char
+    {
+        AUDITOK,
+        AUDITMISSING,
+        AUDITSIZE,
+        AUDITMODIFIED,
+        AUDITUNREADABLE
+    };
+
+    std::vector<boost::filesystem::path> distinfodirs();
+    bool addrecordfiles(boost::filesystem::path);
+    void hashfiles();
+    auditresult
+    hashfile(auditfile &,
+             std::map<std::string, std::unique_ptr<Botan::HashFunction>> &);
+
+    std::string name;
+    boost::filesystem::path destdir;
+    bool verbose;
+    hashlib2botan h2b;
+    std::vector<auditfile> files;
+    std::vector<auditresult> results;
+};
+
+} // namespace crosswrench
+
+#endif
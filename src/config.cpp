@@ -30,6 +30,7 @@ SOFTWARE.
 #include <cstdlib>
 #include <iostream>
 #include <string>
+#include <vector>
 
 namespace crosswrench {
 
@@ -80,15 +81,28 @@ config::instance()
 bool
 config::setup(cxxopts::ParseResult &pr)
 {
-    std::vector<std::string> config_opts{ "destdir",       "installer",
+    std::vector<std::string> config_opts{ "audit",         "destdir",
+                                          "installer",     "manifest",
+                                          "output",        "output-file",
                                           "python",        "script-prefix",
-                                          "script-suffix", "wheel" };
+                                          "script-suffix", "store",
+                                          "uninstall",     "wheel" };
     std::vector<std::string> directurl_opts{ "direct-url",
                                              "direct-url-archive" };
-    std::vector<std::string> path_opts{ "destdir", "python", "wheel" };
+    std::vector<std::string> path_opts{
+        "destdir", "output-file", "python", "store", "wheel"
+    };
+    std::vector<std::string> bool_opts{ "dry-run",
+                                        "durable",
+                                        "io-uring",
+                                        "lazy",
+                                        "skip-installed",
+                                        "stdin",
+                                        "store-hardlink",
+                                        "verbose" };
     new_db.clear();
 
-    if (!verify_python_interpreter(pr)) {
+    if (!verify_python_interpreter(getoptorenv(pr, "python"))) {
         return false;
     }
 
@@ -101,11 +115,13 @@ config::setup(cxxopts::ParseResult &pr)
         }
     }
 
-    if (pr["verbose"].as<bool>()) {
-        new_db["verbose"] = "true";
-    }
-    else {
-        new_db["verbose"] = "false";
+    for (auto &opt : bool_opts) {
+        if (pr[opt].as<bool>()) {
+            new_db[opt] = "true";
+        }
+        else {
+            new_db[opt] = "false";
+        }
     }
 
     for (auto &opt : directurl_opts) {
@@ -117,37 +133,87 @@ config::setup(cxxopts::ParseResult &pr)
         }
     }
 
-    if (!get_framework(pr)) {
+    auto python = getoptorenv(pr, "python");
+    if (!get_framework(python) ||
+        !get_python_paths(python, getoptorenv(pr, "scheme")) ||
+        !get_algos(python))
+    {
         return false;
     }
 
-    if (!get_python_paths(pr)) {
-        return false;
+    std::swap(db, new_db);
+    target_dbs.assign(1, db);
+
+    if (pr.count("target")) {
+        for (auto &target : pr["target"].as<std::vector<std::string>>()) {
+            if (!setup_target(target)) {
+                return false;
+            }
+        }
     }
 
-    if (!get_algos(pr)) {
+    return true;
+}
+
+// a target is python:scheme:destdir, it gets the options of the first
+// target with the paths of its own python interpreter and scheme
+bool
+config::setup_target(std::string target)
+{
+    std::vector<std::string> parts;
+    pystring::split(target, parts, ":", 2);
+    auto python = expandhome(parts.at(0));
+
+    new_db = target_dbs.at(0);
+    new_db["python"] = python;
+    new_db["destdir"] = expandhome(parts.at(2));
+    if (!verify_python_interpreter(python) || !get_framework(python) ||
+        !get_python_paths(python, parts.at(1)) || !get_algos(python))
+    {
         return false;
     }
 
-    std::swap(db, new_db);
+    target_dbs.push_back(new_db);
     return true;
 }
 
+std::size_t
+config::targets()
+{
+    return target_dbs.size();
+}
+
+void
+config::select_target(std::size_t target)
+{
+    db = target_dbs.at(target);
+}
+
+// sets the value for all targets
+void
+config::set_value(std::string key, std::string value)
+{
+    for (auto &target_db : target_dbs) {
+        target_db[key] = value;
+    }
+    db[key] = value;
+}
+
 bool
 config::setup(std::map<std::string, std::string> &input)
 {
     new_db.clear();
     new_db = input;
     std::swap(db, new_db);
+    target_dbs.assign(1, db);
     return true;
 }
 
 bool
-config::get_python_paths(cxxopts::ParseResult &pr)
+config::get_python_paths(std::string python, std::string scheme)
 {
     std::vector<std::string> output;
-    std::string cmd = getoptorenv(pr, "python");
-    std::string scheme = getoptorenv(pr, "scheme");
+    std::string cmd = python;
 
     cmd += pcode_start;
     cmd += get_scheme(scheme);
@@ -169,7 +235,7 @@ config::get_python_paths(cxxopts::ParseResult &pr)
     bool hasallvars = true;
     for (auto &key : python_paths) {
         if (new_db.count(key) == 0) {
-            std::cerr << getoptorenv(pr, "python");
+            std::cerr << python;
             std::cerr << " is missing the path to \"";
             std::cerr << key << "\", config failed";
             std::cerr << std::endl;
@@ -195,18 +261,17 @@ config::print_all()
 }
 
 bool
-config::verify_python_interpreter(cxxopts::ParseResult &pr)
+config::verify_python_interpreter(std::string python)
 {
     std::vector<std::string> output;
-    std::string cmd = getoptorenv(pr, "python");
+    std::string cmd = python;
     cmd += " --version";
     if (get_cmd_output(cmd, output, "")) {
         if (pystring::startswith(pystring::lower(output.at(0)), "python ")) {
             return true;
         }
     }
-    std::cerr << getoptorenv(pr, "python")
-              << " is not a valid python interpreter" << std::endl;
+    std::cerr << python << " is not a valid python interpreter" << std::endl;
 
     return false;
 }
@@ -222,10 +287,10 @@ config::dotdatakeydir2config(std::string &keydir)
 }
 
 bool
-config::get_algos(cxxopts::ParseResult &pr)
+config::get_algos(std::string python)
 {
     std::vector<std::string> output;
-    std::string cmd = getoptorenv(pr, "python");
+    std::string cmd = python;
     cmd += algo_python;
 
     if (!get_cmd_output(cmd, output, "")) {
@@ -238,7 +303,7 @@ config::get_algos(cxxopts::ParseResult &pr)
 }
 
 bool
-config::get_framework(cxxopts::ParseResult &pr)
+config::get_framework(std::string python)
 {
     if (!isosdarwin()) {
         _framework = false;
@@ -248,7 +313,7 @@ config::get_framework(cxxopts::ParseResult &pr)
     std::vector<std::string> output;
     std::string cmd;
 
-    cmd += getoptorenv(pr, "python");
+    cmd += python;
     cmd += framework_python;
 
     if (!get_cmd_output(cmd, output, "")) {
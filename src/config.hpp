@@ -3,8 +3,10 @@
 
 #include <cxxopts.hpp>
 
+#include <cstddef>
 #include <map>
 #include <string>
+#include <vector>
 
 namespace crosswrench {
 
@@ -15,20 +17,25 @@ class config
     bool setup(cxxopts::ParseResult &);
     bool setup(std::map<std::string, std::string> &);
     std::string get_value(std::string);
+    void set_value(std::string, std::string);
+    std::size_t targets();
+    void select_target(std::size_t);
     void print_all();
     config(const config &) = delete;
     config &operator=(const config &) = delete;
     std::string dotdatakeydir2config(std::string &);
 
   private:
-    bool get_algos(cxxopts::ParseResult &);
-    bool get_framework(cxxopts::ParseResult &);
+    bool get_algos(std::string);
+    bool get_framework(std::string);
     std::string get_scheme(std::string &);
-    bool verify_python_interpreter(cxxopts::ParseResult &pr);
-    bool get_python_paths(cxxopts::ParseResult &);
+    bool verify_python_interpreter(std::string);
+    bool get_python_paths(std::string, std::string);
+    bool setup_target(std::string);
     config();
     std::map<std::string, std::string> db;
     std::map<std::string, std::string> new_db;
+    std::vector<std::map<std::string, std::string>> target_dbs;
     std::map<std::string, std::string> dotdatakeydir2config_map;
     bool _framework;
 };
@@ -20,73 +20,82 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#include "audit.hpp"
 #include "config.hpp"
 #include "functions.hpp"
 #include "record.hpp"
 #include "spread.hpp"
+#include "uninstall.hpp"
 #include "wheel.hpp"
+#include "wheelsource.hpp"
+#include "wheelstream.hpp"
 
 #include <boost/filesystem.hpp>
 
+#include <array>
+#include <cstddef>
 #include <cstdlib>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string>
 
 namespace crosswrench {
 
+namespace {
 int
-execute()
+executeuninstall()
 {
-    // the main runner of the program (to be finished)
-
-    if (!iswheelfilenamevalid(config::instance()->get_value("wheel"))) {
-        std::cerr << config::instance()->get_value("wheel")
-                  << " is not a wheelfile based on its filename" << std::endl;
-        return EXIT_FAILURE;
+    try {
+        uninstall remover{ config::instance()->get_value("uninstall") };
+        remover.remove();
     }
-
-    libzippp::ZipArchive wheelfile{ config::instance()->get_value("wheel") };
-
-    if (!wheelfile.open(libzippp::ZipArchive::ReadOnly, true)) {
-        std::cerr << config::instance()->get_value("wheel")
-                  << " could not be opened or is an invalid wheelfile"
-                  << std::endl;
+    catch (std::string s) {
+        std::cerr << s << std::endl;
         return EXIT_FAILURE;
     }
-
-    if (!minimumdistinfofiles(wheelfile)) {
-        std::cerr
-          << config::instance()->get_value("wheel")
-          << " is an invalid wheelfile since it is missing required files"
-          << std::endl;
+    catch (boost::filesystem::filesystem_error &e) {
+        std::cerr << "crosswrench uninstall: " << e.what() << std::endl;
         return EXIT_FAILURE;
     }
 
-    if (wheelhasabsolutepaths(wheelfile)) {
-        std::cerr << config::instance()->get_value("wheel")
-                  << " is an invalid wheelfile since it contains absolute paths"
-                  << std::endl;
-        return EXIT_FAILURE;
-    }
+    return EXIT_SUCCESS;
+}
 
-    if (wheelhasdotdotpath(wheelfile)) {
-        std::cerr << config::instance()->get_value("wheel")
-                  << " has .. in its paths and crosswrench does not support "
-                  << "this for security reasons" << std::endl;
+int
+executeaudit()
+{
+    try {
+        audit auditor{ config::instance()->get_value("audit") };
+        if (!auditor.check()) {
+            return EXIT_FAILURE;
+        }
+    }
+    catch (std::string s) {
+        std::cerr << s << std::endl;
         return EXIT_FAILURE;
     }
-
-    if (!onlyalloweddotdatapaths(wheelfile)) {
-        std::cerr << config::instance()->get_value("wheel")
-                  << " is an invalid wheelfile since it contains paths in "
-                  << dotdatadir() << " that crosswrench doesn't support"
-                  << std::endl;
+    catch (boost::filesystem::filesystem_error &e) {
+        std::cerr << "crosswrench audit: " << e.what() << std::endl;
         return EXIT_FAILURE;
     }
 
+    return EXIT_SUCCESS;
+}
+
+// installs the wheel into the selected target, the wheel is verified
+// against RECORD before it is installed into the first target
+int
+executeinstall(
+  wheelsource &wheelfile,
+  const std::map<std::string, std::array<std::string, 3>> &streamed,
+  bool &verified)
+{
     try {
-        boost::filesystem::create_directories(
-          config::instance()->get_value("destdir"));
+        if (config::instance()->get_value("output") == "fs") {
+            boost::filesystem::create_directories(
+              config::instance()->get_value("destdir"));
+        }
     }
     catch (boost::filesystem::filesystem_error &e) {
         std::cerr << "destdir argument invalid: " << e.what() << std::endl;
@@ -105,18 +114,46 @@ execute()
             return EXIT_FAILURE;
         }
 
-        if (!record_obj.verify(wheelfile)) {
-            std::cerr << config::instance()->get_value("wheel")
-                      << " is an invalid wheel file since the files failed "
-                      << "verification against RECORD" << std::endl;
-            return EXIT_FAILURE;
+        if (!verified && config::instance()->get_value("lazy") == "true") {
+            auto problem =
+              lazyinstallproblem(wheelfile, wheel_obj.root_is_purelib());
+            if (!problem.empty()) {
+                std::cerr << config::instance()->get_value("wheel")
+                          << " can not be installed with --lazy since "
+                          << problem << std::endl;
+                return EXIT_FAILURE;
+            }
         }
 
-        std::cout << config::instance()->get_value("wheel")
-                  << " is a valid wheel file as verified against RECORD"
-                  << std::endl;
+        spread installer{ wheelfile,
+                          wheel_obj.root_is_purelib(),
+                          record_obj };
+
+        // nothing in the wheel is inflated when it is already installed
+        if (config::instance()->get_value("skip-installed") == "true" &&
+            installer.isinstalled())
+        {
+            std::cout << dotdistinfodir() << " is already installed from "
+                      << config::instance()->get_value("wheel")
+                      << ", nothing to do" << std::endl;
+            return EXIT_SUCCESS;
+        }
+
+        if (!verified) {
+            if (!record_obj.verify(wheelfile, streamed)) {
+                std::cerr << config::instance()->get_value("wheel")
+                          << " is an invalid wheel file since the files "
+                          << "failed verification against RECORD"
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+            verified = true;
+
+            std::cout << config::instance()->get_value("wheel")
+                      << " is a valid wheel file as verified against RECORD"
+                      << std::endl;
+        }
 
-        spread installer{ wheelfile, wheel_obj.root_is_purelib() };
         installer.install();
     }
     catch (std::string s) {
@@ -130,5 +167,166 @@ execute()
 
     return EXIT_SUCCESS;
 }
+} // namespace
+
+int
+execute()
+{
+    // the main runner of the program (to be finished)
+
+    if (!config::instance()->get_value("uninstall").empty()) {
+        return executeuninstall();
+    }
+
+    if (!config::instance()->get_value("audit").empty()) {
+        return executeaudit();
+    }
+
+    // the archive is written to stdout, so messages go to stderr
+    if (config::instance()->get_value("output") == "tar" &&
+        config::instance()->get_value("output-file") == "-")
+    {
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+
+    // an unpacked wheel is named like the wheel or like its .dist-info
+    // directory without the extension
+    bool unpacked = config::instance()->get_value("stdin") != "true" &&
+                    boost::filesystem::is_directory(
+                      config::instance()->get_value("wheel"));
+    if (unpacked &&
+        !isunpackedwheelnamevalid(config::instance()->get_value("wheel")))
+    {
+        std::cerr << config::instance()->get_value("wheel")
+                  << " is not an unpacked wheel based on its name"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!unpacked &&
+        !iswheelfilenamevalid(config::instance()->get_value("wheel")))
+    {
+        std::cerr << config::instance()->get_value("wheel")
+                  << " is not a wheelfile based on its filename" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // The wheel is unpacked into a staging directory while it is read, in
+    // the destdir of the first target so that the staged files are on the
+    // filesystem they are installed on. Once the stream has ended and been
+    // checked the staging directory is installed like an unpacked wheel.
+    std::unique_ptr<wheelstream> stream;
+    std::map<std::string, std::array<std::string, 3>> streamed;
+    std::string wheelpath = config::instance()->get_value("wheel");
+    if (config::instance()->get_value("stdin") == "true") {
+        try {
+            config::instance()->select_target(0);
+            auto stageroot = boost::filesystem::temp_directory_path();
+            if (config::instance()->get_value("output") == "fs") {
+                stageroot = config::instance()->get_value("destdir");
+                boost::filesystem::create_directories(stageroot);
+            }
+            stream.reset(new wheelstream{ std::cin, stageroot });
+            stream->read();
+        }
+        catch (std::string s) {
+            std::cerr << s << std::endl;
+            return EXIT_FAILURE;
+        }
+        catch (boost::filesystem::filesystem_error &e) {
+            std::cerr << "crosswrench install: " << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        streamed = stream->hashes();
+        wheelpath = stream->stagepath().string();
+    }
+
+    std::unique_ptr<wheelsource> wheelfile;
+    if (unpacked || stream) {
+        try {
+            wheelfile.reset(new dirsource{ wheelpath });
+        }
+        catch (std::string s) {
+            std::cerr << s << std::endl;
+            return EXIT_FAILURE;
+        }
+        catch (boost::filesystem::filesystem_error &e) {
+            std::cerr << "crosswrench install: " << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    else {
+        auto zipfile = new zipsource{ wheelpath };
+        wheelfile.reset(zipfile);
+        if (!zipfile->open()) {
+            std::cerr << config::instance()->get_value("wheel")
+                      << " could not be opened or is an invalid wheelfile"
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!minimumdistinfofiles(*wheelfile)) {
+        std::cerr
+          << config::instance()->get_value("wheel")
+          << " is an invalid wheelfile since it is missing required files"
+          << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (wheelhasabsolutepaths(*wheelfile)) {
+        std::cerr << config::instance()->get_value("wheel")
+                  << " is an invalid wheelfile since it contains absolute paths"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (wheelhasdotdotpath(*wheelfile)) {
+        std::cerr << config::instance()->get_value("wheel")
+                  << " has .. in its paths and crosswrench does not support "
+                  << "this for security reasons" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!onlyalloweddotdatapaths(*wheelfile)) {
+        std::cerr << config::instance()->get_value("wheel")
+                  << " is an invalid wheelfile since it contains paths in "
+                  << dotdatadir() << " that crosswrench doesn't support"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // With more than one target the wheel is inflated once into a temporary
+    // store and every target is materialized from it. The store is kept in
+    // the destdir of the first target, on the same filesystem as the
+    // installed files so that they can be reflinked from it.
+    boost::filesystem::path fanoutstore;
+    if (config::instance()->targets() > 1 &&
+        config::instance()->get_value("store").empty())
+    {
+        config::instance()->select_target(0);
+        boost::filesystem::path destdir{ config::instance()->get_value(
+          "destdir") };
+        fanoutstore = destdir / boost::filesystem::unique_path(
+                                  ".crosswrench-fanout-%%%%-%%%%-%%%%");
+        config::instance()->set_value("store", fanoutstore.string());
+    }
+
+    int retval = EXIT_SUCCESS;
+    bool verified = false;
+    for (std::size_t i = 0; i < config::instance()->targets(); i++) {
+        config::instance()->select_target(i);
+        retval = executeinstall(*wheelfile, streamed, verified);
+        if (retval != EXIT_SUCCESS) {
+            break;
+        }
+    }
+
+    if (!fanoutstore.empty()) {
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(fanoutstore, ec);
+    }
+
+    return retval;
+}
 
 } // namespace crosswrench
@@ -30,14 +30,30 @@ SOFTWARE.
 #include <pstream.h>
 #include <pystring.h>
 
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
 #include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <set>
 #include <string>
 #include <thread>
 #include <vector>
@@ -49,15 +65,24 @@ std::string
 distdashversion()
 {
     std::vector<std::string> result;
-    std::string wheelarg = config::instance()->get_value("wheel");
+    // an unpacked wheel can be given with a trailing /
+    std::string wheelarg =
+      pystring::rstrip(config::instance()->get_value("wheel"), "/");
     boost::filesystem::path wheelpath{ wheelarg };
     std::string wheelname = wheelpath.filename().string();
     pystring::split(wheelname, result, "-");
-    result.erase(result.begin() + 2, result.end());
+    if (result.size() > 2) {
+        result.erase(result.begin() + 2, result.end());
+    }
 
     return pystring::join("-", result);
 }
 
+// the fixed part of the records in the zip --lazy writes
+const std::uint64_t ZIPLOCALSIZE = 30;
+const std::uint64_t ZIPCENTRALSIZE = 46;
+const std::uint64_t ZIPENDSIZE = 22;
+
 std::map<std::string, std::string> opt2env{ { "destdir", "DESTDIR" },
                                             { "python", "PYTHON" } };
 
@@ -77,6 +102,56 @@ std::map<int, std::string> libzippdef2str{
 };
 } // namespace
 
+std::string
+distname()
+{
+    std::vector<std::string> result;
+    pystring::split(distdashversion(), result, "-");
+
+    return result.at(0);
+}
+
+// the name normalized as done for .dist-info directories, so that
+// Foo.Bar, foo-bar and foo_bar are the same distribution
+std::string
+normalizedistname(std::string name)
+{
+    name = pystring::lower(name);
+    std::replace(name.begin(), name.end(), '-', '_');
+    std::replace(name.begin(), name.end(), '.', '_');
+
+    return name;
+}
+
+// finds the .dist-info directory in dir of any installed version of the
+// distribution name, an empty path is returned if there is none
+boost::filesystem::path
+installeddistinfo(boost::filesystem::path dir, std::string name)
+{
+    boost::system::error_code ec;
+    auto wanted = normalizedistname(name);
+
+    for (boost::filesystem::directory_iterator i{ dir, ec }, end;
+         !ec && i != end;
+         i.increment(ec))
+    {
+        auto dirname = i->path().filename().string();
+        if (!pystring::endswith(dirname, ".dist-info") ||
+            !boost::filesystem::is_directory(i->path()))
+        {
+            continue;
+        }
+
+        std::vector<std::string> result;
+        pystring::split(dirname, result, "-");
+        if (normalizedistname(result.at(0)) == wanted) {
+            return i->path();
+        }
+    }
+
+    return boost::filesystem::path{};
+}
+
 std::string
 dotdistinfodir()
 {
@@ -124,8 +199,28 @@ iswheelfilenamevalid(const std::string &filepath)
     return true;
 }
 
+// an unpacked wheel is named like the wheel file or like its .dist-info
+// directory without the extension, a trailing / is allowed
+bool
+isunpackedwheelnamevalid(const std::string &dirpath)
+{
+    boost::filesystem::path wheelpath{ pystring::rstrip(dirpath, "/") };
+    std::string wheelname = wheelpath.filename().string();
+
+    std::vector<std::string> splited;
+    pystring::split(wheelname, splited, "-");
+    if (std::any_of(splited.begin(), splited.end(), [](std::string &part) {
+            return part.empty();
+        }))
+    {
+        return false;
+    }
+
+    return splited.size() == 2 || iswheelfilenamevalid(wheelname + ".whl");
+}
+
 bool
-minimumdistinfofiles(libzippp::ZipArchive &ar)
+minimumdistinfofiles(wheelsource &ar)
 {
     std::array<std::string, 3> reqfiles{ "/METADATA", "/RECORD", "/WHEEL" };
     auto pred = [&](std::string &filename) {
@@ -230,9 +325,9 @@ get_cmd_output(std::string &cmd,
 }
 
 bool
-wheelhasabsolutepaths(libzippp::ZipArchive &ar)
+wheelhasabsolutepaths(wheelsource &ar)
 {
-    auto pred = [](libzippp::ZipEntry &e) {
+    auto pred = [](wheelentry &e) {
         return pystring::startswith(e.getName(), "/");
     };
 
@@ -242,7 +337,7 @@ wheelhasabsolutepaths(libzippp::ZipArchive &ar)
 }
 
 bool
-onlyalloweddotdatapaths(libzippp::ZipArchive &ar)
+onlyalloweddotdatapaths(wheelsource &ar)
 {
     auto entries = ar.getEntries();
 
@@ -273,7 +368,7 @@ onlyalloweddotdatapaths(libzippp::ZipArchive &ar)
 }
 
 bool
-isscript(libzippp::ZipEntry &entry)
+isscript(wheelentry &entry)
 {
     return pystring::startswith(entry.getName(), dotdatadir() + "/scripts/");
 }
@@ -310,7 +405,7 @@ getelf32(std::uint8_t endian, const std::uint8_t *data)
 }
 
 bool
-iselfexec(libzippp::ZipEntry &entry, libzippp::ZipArchive &wheel)
+iselfexec(const std::uint8_t *data, std::size_t data_size)
 {
     const std::uint8_t elf_magic[] = { 0x7F, 0x45, 0x4c, 0x46 };
 
@@ -322,22 +417,10 @@ iselfexec(libzippp::ZipEntry &entry, libzippp::ZipArchive &wheel)
     const std::uint16_t elf_shared = 0x03;
     const size_t elf_hdrsize = 0x40;
 
-    if (entry.getSize() < elf_hdrsize) {
+    if (data_size < elf_hdrsize) {
         return false;
     }
 
-    std::uint8_t *data =
-      (std::uint8_t *)entry.readAsBinary(libzippp::ZipArchive::Original,
-                                         elf_hdrsize);
-
-    if (data == nullptr) {
-        std::string elf_error{ "iselfexec: could not read " };
-        elf_error += entry.getName();
-        elf_error += " in ";
-        elf_error += wheel.getPath();
-        throw elf_error;
-    }
-
     int magic = std::memcmp(data, elf_magic, sizeof(elf_magic));
 
     std::uint8_t ei_class = data[0x04];
@@ -346,16 +429,29 @@ iselfexec(libzippp::ZipEntry &entry, libzippp::ZipArchive &wheel)
     std::uint16_t e_type = getelf16(ei_endian, data + 0x10);
     std::uint32_t e_version = getelf32(ei_endian, data + 0x14);
 
-    delete[] data;
-
     return (magic == 0) && (ei_class == elf_32bit || ei_class == elf_64bit) &&
            (ei_endian == elf_little || ei_endian == elf_big) &&
            (ei_version == 1) && (e_type == elf_exec || e_type == elf_shared) &&
            (e_version == 1);
 }
 
+bool
+iselfexecfile(const boost::filesystem::path &filepath)
+{
+    std::uint8_t header[0x40];
+
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    ssize_t ret = pread(fd, header, sizeof(header), 0);
+    close(fd);
+
+    return ret > 0 && iselfexec(header, ret);
+}
+
 std::map<std::string, std::string>
-getentrypointscripts(libzippp::ZipEntry &entry)
+getentrypointscripts(wheelentry &entry)
 {
     std::map<std::string, std::string> scripts;
 
@@ -414,18 +510,8 @@ createscript(std::string &rhs)
     return script;
 }
 
-void
-setexecperms(boost::filesystem::path filepath)
-{
-    boost::filesystem::permissions(filepath,
-                                   boost::filesystem::perms::owner_exe |
-                                     boost::filesystem::perms::group_exe |
-                                     boost::filesystem::perms::others_exe |
-                                     boost::filesystem::perms::add_perms);
-}
-
 bool
-wheelhasdotdotpath(libzippp::ZipArchive &ar)
+wheelhasdotdotpath(wheelsource &ar)
 {
     std::string dotdot{ ".." };
     auto entries = ar.getEntries();
@@ -549,4 +635,408 @@ libzipppretcodestr(int retcode)
     return v->second;
 }
 
+// calls func with every index from 0 to count - 1 spread over one thread
+// per cpu, the first exception thrown by func is rethrown when all threads
+// are done
+void
+runparallel(std::size_t count, std::function<void(std::size_t)> func)
+{
+    std::size_t nthreads = std::thread::hardware_concurrency();
+    nthreads = std::max<std::size_t>(1, std::min(nthreads, count));
+    std::atomic<std::size_t> next{ 0 };
+    std::exception_ptr error;
+    std::mutex error_m;
+
+    auto worker = [&]() {
+        std::size_t i;
+        while ((i = next++) < count) {
+            try {
+                func(i);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock{ error_m };
+                if (!error) {
+                    error = std::current_exception();
+                }
+                next = count;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t t = 1; t < nthreads; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// calls func with the whole content of the file, mapped into memory when
+// it is not empty
+bool
+readfile(const boost::filesystem::path &filepath,
+         std::function<void(const std::uint8_t *, std::size_t)> func)
+{
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        close(fd);
+        return false;
+    }
+
+    if (sb.st_size == 0) {
+        close(fd);
+        func(nullptr, 0);
+        return true;
+    }
+
+    void *data = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, sb.st_size, MADV_SEQUENTIAL);
+
+    try {
+        func((const std::uint8_t *)data, sb.st_size);
+    }
+    catch (...) {
+        munmap(data, sb.st_size);
+        throw;
+    }
+    munmap(data, sb.st_size);
+
+    return true;
+}
+
+// calls func with length bytes at offset in the file, mapped into memory
+// when length is not zero
+bool
+readfilerange(const boost::filesystem::path &filepath,
+              std::uint64_t offset,
+              std::uint64_t length,
+              std::function<void(const std::uint8_t *, std::size_t)> func)
+{
+    if (length == 0) {
+        func(nullptr, 0);
+        return true;
+    }
+
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || (std::uint64_t)sb.st_size < offset ||
+        (std::uint64_t)sb.st_size - offset < length)
+    {
+        close(fd);
+        return false;
+    }
+
+    // a mapping starts at a page boundary
+    std::uint64_t pagesize = sysconf(_SC_PAGESIZE);
+    std::uint64_t start = offset - offset % pagesize;
+    std::size_t maplength = length + (offset - start);
+    void *data = mmap(nullptr, maplength, PROT_READ, MAP_PRIVATE, fd, start);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, maplength, MADV_SEQUENTIAL);
+
+    try {
+        func((const std::uint8_t *)data + (offset - start), length);
+    }
+    catch (...) {
+        munmap(data, maplength);
+        throw;
+    }
+    munmap(data, maplength);
+
+    return true;
+}
+
+// the little endian value of len bytes at pos in data, as in zip headers
+std::uint64_t
+getle(const std::string &data, std::size_t pos, std::size_t len)
+{
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < len; i++) {
+        value |= std::uint64_t((std::uint8_t)data.at(pos + i)) << (8 * i);
+    }
+    return value;
+}
+
+// removes the directories that are empty, and then their parents that
+// become empty, in one pass from the deepest level up and never any of the
+// directories in keep
+void
+prunedirs(std::set<boost::filesystem::path> dirs,
+          const std::set<boost::filesystem::path> &keep)
+{
+    std::map<std::size_t,
+             std::set<boost::filesystem::path>,
+             std::greater<std::size_t>>
+      levels;
+    for (auto &dir : dirs) {
+        levels[std::distance(dir.begin(), dir.end())].insert(dir);
+    }
+
+    while (!levels.empty()) {
+        auto level = levels.begin();
+        for (auto &dir : level->second) {
+            if (keep.count(dir) != 0 || !dir.has_parent_path()) {
+                continue;
+            }
+
+            // rmdir only removes empty directories
+            if (rmdir(dir.c_str()) == 0) {
+                levels[level->first - 1].insert(dir.parent_path());
+            }
+        }
+        levels.erase(level);
+    }
+}
+
+// The bytes and inodes the files need are summed per filesystem and
+// compared with what statvfs reports as available to unprivileged users.
+// A file needs its size rounded up to whole fragments and an inode, every
+// directory that does not exist yet needs an inode. A report of the
+// filesystems that are short is returned, it is empty if all files fit.
+std::string
+freespaceshortfall(
+  const std::vector<std::pair<boost::filesystem::path, std::uint64_t>> &files)
+{
+    struct fsneed
+    {
+        boost::filesystem::path dir;
+        struct statvfs vfs;
+        std::uint64_t bytes;
+        std::uint64_t inodes;
+    };
+    std::map<dev_t, fsneed> needs;
+    std::map<boost::filesystem::path, dev_t> dirdevs;
+    std::set<boost::filesystem::path> newdirs;
+
+    for (auto &file : files) {
+        // the nearest existing directory decides the filesystem
+        auto dir = file.first.parent_path();
+        std::vector<boost::filesystem::path> missing;
+        struct stat sb;
+        while (dirdevs.count(dir) == 0 && stat(dir.c_str(), &sb) != 0 &&
+               dir.has_parent_path())
+        {
+            missing.push_back(dir);
+            dir = dir.parent_path();
+        }
+        if (dirdevs.count(dir) == 0) {
+            if (stat(dir.c_str(), &sb) != 0) {
+                continue;
+            }
+            dirdevs[dir] = sb.st_dev;
+        }
+        auto dev = dirdevs[dir];
+
+        if (needs.count(dev) == 0) {
+            fsneed need{ dir, {}, 0, 0 };
+            if (statvfs(dir.c_str(), &need.vfs) != 0) {
+                continue;
+            }
+            needs[dev] = need;
+        }
+        auto &need = needs[dev];
+
+        for (auto &m : missing) {
+            if (newdirs.insert(m).second) {
+                need.inodes++;
+            }
+        }
+
+        std::uint64_t frsize = need.vfs.f_frsize ? need.vfs.f_frsize : 1;
+        need.bytes += (file.second + frsize - 1) / frsize * frsize;
+        need.inodes++;
+    }
+
+    std::string report;
+    for (auto &n : needs) {
+        auto &need = n.second;
+        std::uint64_t bytesfree =
+          (std::uint64_t)need.vfs.f_bavail * need.vfs.f_frsize;
+        if (need.bytes > bytesfree) {
+            report += "\n  the filesystem of " + need.dir.string() +
+                      " needs " + std::to_string(need.bytes) + " bytes but " +
+                      std::to_string(bytesfree) + " are free, " +
+                      std::to_string(need.bytes - bytesfree) + " bytes short";
+        }
+        // filesystems without a fixed number of inodes report none
+        if (need.vfs.f_files != 0 && need.inodes > need.vfs.f_favail) {
+            report += "\n  the filesystem of " + need.dir.string() +
+                      " needs " + std::to_string(need.inodes) +
+                      " inodes but " + std::to_string(need.vfs.f_favail) +
+                      " are free, " +
+                      std::to_string(need.inodes - need.vfs.f_favail) +
+                      " inodes short";
+        }
+    }
+
+    return report;
+}
+
+// the byte-compiled files of a .py file, they are not in RECORD since they
+// are created after it is written
+std::vector<boost::filesystem::path>
+pycachefiles(boost::filesystem::path pyfile)
+{
+    std::vector<boost::filesystem::path> pycfiles;
+    auto pycachedir = pyfile.parent_path() / "__pycache__";
+    auto prefix = pyfile.stem().string() + ".";
+    boost::system::error_code ec;
+
+    if (!boost::filesystem::is_directory(pycachedir, ec)) {
+        return pycfiles;
+    }
+
+    for (auto &d : boost::filesystem::directory_iterator(pycachedir, ec)) {
+        auto filename = d.path().filename().string();
+        if (pystring::startswith(filename, prefix) &&
+            pystring::endswith(filename, ".pyc"))
+        {
+            pycfiles.push_back(d.path());
+        }
+    }
+
+    return pycfiles;
+}
+
+// purelib and platlib in destdir, the directories .dist-info directories
+// are installed into
+std::set<boost::filesystem::path>
+installroots(boost::filesystem::path destdir)
+{
+    return std::set<boost::filesystem::path>{
+        (destdir / rootinstalldir(true)).lexically_normal(),
+        (destdir / rootinstalldir(false)).lexically_normal()
+    };
+}
+
+// destdir and the install directories of the scheme in it, these are never
+// pruned
+std::set<boost::filesystem::path>
+schemeinstalldirs(boost::filesystem::path destdir)
+{
+    std::set<boost::filesystem::path> dirs{ destdir.lexically_normal() };
+    for (auto key : { "data", "headers", "platlib", "purelib", "scripts" }) {
+        dirs.insert((destdir / dotdatainstalldir(key)).lexically_normal());
+    }
+
+    return dirs;
+}
+
+// the modification time of files crosswrench writes to archives, taken
+// from SOURCE_DATE_EPOCH so that they are reproducible
+std::int64_t
+sourcedateepoch()
+{
+    char *envstr = std::getenv("SOURCE_DATE_EPOCH");
+    if (envstr == nullptr) {
+        return 0;
+    }
+
+    char *end;
+    errno = 0;
+    long long epoch = std::strtoll(envstr, &end, 10);
+    if (errno != 0 || end == envstr || *end != '\0' || epoch < 0) {
+        std::string msg{ "crosswrench install: SOURCE_DATE_EPOCH is not "
+                         "a valid timestamp: " };
+        msg += envstr;
+        throw msg;
+    }
+
+    return epoch;
+}
+
+// what keeps a wheel from being installed with --lazy, an empty string if
+// nothing does. zipimport can only load pure python modules and the
+// modules are stored in a zip without zip64 extensions, the zip is laid
+// out here the way spread writes it so that one that doesn't fit is
+// refused before anything is written.
+std::string
+lazyinstallproblem(wheelsource &ar, bool rootispurelib)
+{
+    if (!rootispurelib) {
+        return "it is not Root-Is-Purelib";
+    }
+
+    std::uint64_t files = 0;
+    std::uint64_t local = 0;
+    std::uint64_t central = 0;
+    std::set<std::string> dirs;
+    for (auto &entry : ar.getEntries()) {
+        auto name = entry.getName();
+        bool indata = pystring::startswith(name, dotdatadir() + "/");
+        if (pystring::startswith(name, dotdistinfodir() + "/") ||
+            (indata && entry.isDirectory()))
+        {
+            continue;
+        }
+        if (indata &&
+            !pystring::startswith(name, dotdatadir() + "/scripts/"))
+        {
+            return name + " is not a script";
+        }
+        auto filename = boost::filesystem::path{ name }.filename().string();
+        for (auto ext : { ".so", ".pyd", ".dll", ".dylib" }) {
+            if (pystring::endswith(filename, ext) ||
+                filename.find(std::string{ ext } + ".") != std::string::npos)
+            {
+                return name + " is a native library";
+            }
+        }
+        if (indata) {
+            continue;
+        }
+
+        // directories get an entry of their own whether the wheel has one
+        // or not
+        std::vector<std::string> parts;
+        pystring::split(name, parts, "/");
+        std::string dir;
+        for (std::size_t i = 0; i + 1 < parts.size(); i++) {
+            dir += parts[i] + "/";
+            dirs.insert(dir);
+        }
+        if (entry.isDirectory()) {
+            continue;
+        }
+        files++;
+        local += ZIPLOCALSIZE + name.size() + entry.getSize();
+        central += ZIPCENTRALSIZE + name.size();
+    }
+    for (auto &dir : dirs) {
+        local += ZIPLOCALSIZE + dir.size();
+        central += ZIPCENTRALSIZE + dir.size();
+    }
+
+    if (files + dirs.size() >= 0xffff) {
+        return "it has too many files";
+    }
+    if (local + central + ZIPENDSIZE > 0xffffffff) {
+        return "its files are too large";
+    }
+
+    return "";
+}
+
 } // namespace crosswrench
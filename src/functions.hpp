@@ -1,37 +1,48 @@
 #if !defined(_SRC_FUNCTIONS_HPP_)
 #define _SRC_FUNCTIONS_HPP_
 
+#include "wheelsource.hpp"
+
 #include <boost/filesystem.hpp>
 #include <cxxopts.hpp>
-#include <libzippp.h>
 
+#include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <map>
+#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace crosswrench {
+std::string distname();
+std::string normalizedistname(std::string);
+boost::filesystem::path installeddistinfo(boost::filesystem::path,
+                                          std::string);
 std::string dotdistinfodir();
 std::string dotdatadir();
 bool isbase64urlsafenopad(const std::string &);
 bool iswheelfilenamevalid(const std::string &);
-bool minimumdistinfofiles(libzippp::ZipArchive &);
+bool isunpackedwheelnamevalid(const std::string &);
+bool minimumdistinfofiles(wheelsource &);
 std::string base64urlsafenopad(std::string);
 bool isrecordfilenames(std::string);
 boost::filesystem::path rootinstalldir(bool);
 boost::filesystem::path installdir(std::string);
 bool get_cmd_output(std::string &, std::vector<std::string> &, std::string);
-bool wheelhasabsolutepaths(libzippp::ZipArchive &);
-bool onlyalloweddotdatapaths(libzippp::ZipArchive &);
+bool wheelhasabsolutepaths(wheelsource &);
+bool onlyalloweddotdatapaths(wheelsource &);
 boost::filesystem::path dotdatainstalldir(std::string);
-bool isscript(libzippp::ZipEntry &);
+bool isscript(wheelentry &);
 bool strvec_contains(std::vector<std::string> &, std::string &);
 std::uint16_t getelf16(std::uint8_t, const std::uint8_t *);
 std::uint32_t getelf32(std::uint8_t, const std::uint8_t *);
-bool iselfexec(libzippp::ZipEntry &, libzippp::ZipArchive &);
-std::map<std::string, std::string> getentrypointscripts(libzippp::ZipEntry &);
+bool iselfexec(const std::uint8_t *, std::size_t);
+bool iselfexecfile(const boost::filesystem::path &);
+std::map<std::string, std::string> getentrypointscripts(wheelentry &);
 std::string createscript(std::string &);
-void setexecperms(boost::filesystem::path);
-bool wheelhasdotdotpath(libzippp::ZipArchive &);
+bool wheelhasdotdotpath(wheelsource &);
 std::string expandhome(std::string);
 int countoptorenv(cxxopts::ParseResult &, std::string);
 std::string getoptorenv(cxxopts::ParseResult &, std::string);
@@ -40,6 +51,23 @@ bool isosdarwin();
 std::string envdescmsg(std::string opt);
 std::string envmsg(std::string opt, std::vector<std::string> &vmsg);
 std::string libzipppretcodestr(int);
+void runparallel(std::size_t, std::function<void(std::size_t)>);
+bool readfile(const boost::filesystem::path &,
+              std::function<void(const std::uint8_t *, std::size_t)>);
+bool readfilerange(const boost::filesystem::path &,
+                   std::uint64_t,
+                   std::uint64_t,
+                   std::function<void(const std::uint8_t *, std::size_t)>);
+std::uint64_t getle(const std::string &, std::size_t, std::size_t);
+void prunedirs(std::set<boost::filesystem::path>,
+               const std::set<boost::filesystem::path> &);
+std::vector<boost::filesystem::path> pycachefiles(boost::filesystem::path);
+std::string freespaceshortfall(
+  const std::vector<std::pair<boost::filesystem::path, std::uint64_t>> &);
+std::set<boost::filesystem::path> installroots(boost::filesystem::path);
+std::set<boost::filesystem::path> schemeinstalldirs(boost::filesystem::path);
+std::int64_t sourcedateepoch();
+std::string lazyinstallproblem(wheelsource &, bool);
 } // namespace crosswrench
 
 #endif
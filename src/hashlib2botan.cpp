@@ -25,12 +25,16 @@ SOFTWARE.
 #include "config.hpp"
 #include "functions.hpp"
 
+#include <botan/base64.h>
 #include <botan/hash.h>
 #include <pystring.h>
 
 #include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -115,4 +119,38 @@ hashlib2botan::print_guaranteed()
     }
 }
 
+filehasher::filehasher(std::string botanname, bool withsha256)
+  : hasher{ Botan::HashFunction::create(botanname) }
+{
+    if (withsha256) {
+        sha256 = Botan::HashFunction::create("SHA-256");
+    }
+}
+
+void
+filehasher::update(const void *data, std::size_t data_size)
+{
+    hasher->update((const std::uint8_t *)data, data_size);
+    if (sha256) {
+        sha256->update((const std::uint8_t *)data, data_size);
+    }
+}
+
+std::string
+filehasher::digest()
+{
+    return base64urlsafenopad(Botan::base64_encode(hasher->final()));
+}
+
+// empty unless the sha256 digest was asked for
+std::string
+filehasher::sha256digest()
+{
+    if (!sha256) {
+        return std::string{};
+    }
+
+    return base64urlsafenopad(Botan::base64_encode(sha256->final()));
+}
+
 } // namespace crosswrench
@@ -2,8 +2,12 @@
 #if !defined(_SRC_HASHLIB2BOTAN_HPP_)
 #define _SRC_HASHLIB2BOTAN_HPP_
 
+#include <botan/hash.h>
+
 #include <array>
+#include <cstddef>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -24,6 +28,21 @@ class hashlib2botan
     std::array<std::string, 4> algorithms_by_strength;
     std::string best_algo;
 };
+
+// hashes an installed file with the hash RECORD uses and, for an mtree
+// manifest that can't use that hash, with sha256 as well
+class filehasher
+{
+  public:
+    filehasher(std::string, bool);
+    void update(const void *, std::size_t);
+    std::string digest();
+    std::string sha256digest();
+
+  private:
+    std::unique_ptr<Botan::HashFunction> hasher;
+    std::unique_ptr<Botan::HashFunction> sha256;
+};
 } // namespace crosswrench
 
 #endif
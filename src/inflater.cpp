@@ -0,0 +1,188 @@
+/*
+Copyright (c) 2022 Niclas Rosenvik
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "inflater.hpp"
+
+#if defined(USE_LIBDEFLATE)
+#include <libdeflate.h>
+#elif defined(USE_ZLIB_NG)
+#include <zlib-ng.h>
+#else
+#include <zlib.h>
+#endif
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace crosswrench {
+
+namespace {
+#if defined(USE_LIBDEFLATE)
+// libdeflate only decodes whole buffers, the buffer holds the entry and is
+// handed to output at once
+class libdeflateinflater : public inflater
+{
+  public:
+    std::uint64_t
+    buffersize(std::uint64_t size, std::uint64_t) const override
+    {
+        return std::max<std::uint64_t>(1, size);
+    }
+
+    bool
+    inflate(const std::uint8_t *in,
+            std::uint64_t insize,
+            std::uint64_t size,
+            std::uint8_t *buffer,
+            std::uint64_t,
+            std::function<bool(const std::uint8_t *, std::uint64_t)> output)
+      const override
+    {
+        auto decompressor = libdeflate_alloc_decompressor();
+        if (decompressor == nullptr) {
+            return false;
+        }
+        std::size_t actual = 0;
+        auto ret = libdeflate_deflate_decompress(
+          decompressor, in, insize, buffer, size, &actual);
+        libdeflate_free_decompressor(decompressor);
+
+        return ret == LIBDEFLATE_SUCCESS && actual == size &&
+               (size == 0 || output(buffer, size));
+    }
+};
+#else
+// zlib and the native api of zlib-ng differ only in their names
+#if defined(USE_ZLIB_NG)
+typedef zng_stream zstream;
+
+int
+zinit(zstream *stream)
+{
+    return zng_inflateInit2(stream, -MAX_WBITS);
+}
+
+int
+zinflate(zstream *stream)
+{
+    return zng_inflate(stream, Z_NO_FLUSH);
+}
+
+void
+zend(zstream *stream)
+{
+    zng_inflateEnd(stream);
+}
+#else
+typedef z_stream zstream;
+
+int
+zinit(zstream *stream)
+{
+    return inflateInit2(stream, -MAX_WBITS);
+}
+
+int
+zinflate(zstream *stream)
+{
+    return inflate(stream, Z_NO_FLUSH);
+}
+
+void
+zend(zstream *stream)
+{
+    inflateEnd(stream);
+}
+#endif
+
+// the data is inflated into a buffer of one chunk that is handed to output
+// each time it is full
+class zlibinflater : public inflater
+{
+  public:
+    std::uint64_t
+    buffersize(std::uint64_t size, std::uint64_t chunksize) const override
+    {
+        return std::max<std::uint64_t>(1, std::min(size, chunksize));
+    }
+
+    bool
+    inflate(const std::uint8_t *in,
+            std::uint64_t insize,
+            std::uint64_t size,
+            std::uint8_t *buffer,
+            std::uint64_t buffersize,
+            std::function<bool(const std::uint8_t *, std::uint64_t)> output)
+      const override
+    {
+        zstream stream{};
+        if (zinit(&stream) != Z_OK) {
+            return false;
+        }
+
+        // avail_in and avail_out are 32 bits, the input is given in parts
+        std::uint64_t inflated = 0;
+        int ret = Z_OK;
+        while (ret == Z_OK) {
+            if (stream.avail_in == 0 && insize != 0) {
+                auto len = std::min<std::uint64_t>(insize, UINT_MAX);
+                stream.next_in = (decltype(stream.next_in))in;
+                stream.avail_in = len;
+                in += len;
+                insize -= len;
+            }
+            auto outlen = std::min<std::uint64_t>(buffersize, UINT_MAX);
+            stream.next_out = buffer;
+            stream.avail_out = outlen;
+            ret = zinflate(&stream);
+            if (ret != Z_OK && ret != Z_STREAM_END) {
+                break;
+            }
+            auto len = outlen - stream.avail_out;
+            inflated += len;
+            if (inflated > size || (len != 0 && !output(buffer, len))) {
+                ret = Z_DATA_ERROR;
+            }
+        }
+        zend(&stream);
+
+        return ret == Z_STREAM_END && inflated == size;
+    }
+};
+#endif
+} // namespace
+
+std::unique_ptr<inflater>
+inflater::create()
+{
+#if defined(USE_LIBDEFLATE)
+    return std::unique_ptr<inflater>{ new libdeflateinflater };
+#else
+    return std::unique_ptr<inflater>{ new zlibinflater };
+#endif
+}
+
+} // namespace crosswrench
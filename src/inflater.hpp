@@ -0,0 +1,32 @@
+#if !defined(_SRC_INFLATER_HPP_)
+#define _SRC_INFLATER_HPP_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace crosswrench {
+
+// Decodes the raw deflate data of a zip entry into a buffer the caller
+// provides, the library that does it is chosen when crosswrench is built.
+// buffersize tells how large the buffer must be for an entry of a size read
+// in chunks of a size, inflate hands the buffer to output each time it is
+// filled and fails if the data doesn't inflate to exactly the entry size.
+class inflater
+{
+  public:
+    virtual ~inflater() = default;
+    virtual std::uint64_t buffersize(std::uint64_t, std::uint64_t) const = 0;
+    virtual bool inflate(
+      const std::uint8_t *,
+      std::uint64_t,
+      std::uint64_t,
+      std::uint8_t *,
+      std::uint64_t,
+      std::function<bool(const std::uint8_t *, std::uint64_t)>) const = 0;
+    static std::unique_ptr<inflater> create();
+};
+
+} // namespace crosswrench
+
+#endif
@@ -0,0 +1,119 @@
+/*
+Copyright (c) 2022 Niclas Rosenvik
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "lockfile.hpp"
+
+#include "functions.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <iostream>
+#include <string>
+
+namespace crosswrench {
+
+// Advisory locks taken with flock, they are released when the process
+// exits so a crashed install never leaves a lock behind. The lock files
+// are kept in purelib and are never removed since another process can be
+// waiting on them.
+lockfile::lockfile(boost::filesystem::path _lockpath)
+  : lockpath{ _lockpath }
+  , fd{ -1 }
+{}
+
+lockfile::~lockfile()
+{
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+// waits for the lock and says so if it is held by another process
+void
+lockfile::lock()
+{
+    if (trylock()) {
+        return;
+    }
+
+    std::cout << "Waiting for the lock " << lockpath.string() << std::endl;
+    int ret;
+    while ((ret = flock(fd, LOCK_EX)) == -1 && errno == EINTR) {
+    }
+    if (ret == -1) {
+        std::string msg{ "crosswrench: could not lock " };
+        msg += lockpath.string();
+        throw msg;
+    }
+}
+
+bool
+lockfile::trylock()
+{
+    if (!open()) {
+        std::string msg{ "crosswrench: could not open " };
+        msg += lockpath.string();
+        throw msg;
+    }
+
+    return flock(fd, LOCK_EX | LOCK_NB) == 0;
+}
+
+void
+lockfile::unlock()
+{
+    if (fd != -1) {
+        flock(fd, LOCK_UN);
+    }
+}
+
+// held while the .dist-info directories and the journals in purelib and
+// platlib are read and while an install claims its paths
+boost::filesystem::path
+lockfile::globalpath(boost::filesystem::path root)
+{
+    return root / ".crosswrench.lock";
+}
+
+// held for all of an install or uninstall of the distribution name
+boost::filesystem::path
+lockfile::distpath(boost::filesystem::path root, std::string name)
+{
+    return root / ("." + normalizedistname(name) + ".crosswrench.lock");
+}
+
+bool
+lockfile::open()
+{
+    if (fd == -1) {
+        fd = ::open(lockpath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    }
+
+    return fd != -1;
+}
+
+} // namespace crosswrench
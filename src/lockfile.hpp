@@ -0,0 +1,33 @@
+#if !defined(_SRC_LOCKFILE_HPP_)
+#define _SRC_LOCKFILE_HPP_
+
+#include <boost/filesystem.hpp>
+
+#include <string>
+
+namespace crosswrench {
+
+class lockfile
+{
+  public:
+    lockfile(boost::filesystem::path);
+    ~lockfile();
+    lockfile(const lockfile &) = delete;
+    lockfile &operator=(const lockfile &) = delete;
+    void lock();
+    bool trylock();
+    void unlock();
+    static boost::filesystem::path globalpath(boost::filesystem::path);
+    static boost::filesystem::path distpath(boost::filesystem::path,
+                                            std::string);
+
+  private:
+    bool open();
+
+    boost::filesystem::path lockpath;
+    int fd;
+};
+
+} // namespace crosswrench
+
+#endif
@@ -26,6 +26,7 @@ SOFTWARE.
 #include "license.hpp"
 
 #include <cxxopts.hpp>
+#include <pystring.h>
 
 #include <cstdlib>
 #include <iostream>
@@ -43,6 +44,10 @@ main(int argc, char *argv[])
 
         // clang-format off
         options.add_options()
+            ("audit",
+              "check installed files against RECORD, of all distributions "
+              "or of the named one",
+              cxxopts::value<std::string>()->implicit_value("*"))
             ("destdir",
               "destination root" + crosswrench::envdescmsg("destdir"),
               cxxopts::value<std::string>()->implicit_value(""))
@@ -50,10 +55,30 @@ main(int argc, char *argv[])
               cxxopts::value<std::string>()->implicit_value(""))
             ("direct-url-archive", "file to base the direct url hash on",
               cxxopts::value<std::string>()->implicit_value(""))
+            ("dry-run", "list the files --uninstall would remove",
+              cxxopts::value<bool>()->default_value("false"))
+            ("durable", "sync installed files to disk before writing RECORD",
+              cxxopts::value<bool>()->default_value("false"))
+            ("io-uring", "write small files with io_uring if available",
+              cxxopts::value<bool>()->default_value("false"))
             ("installer", "installer name",
               cxxopts::value<std::string>()->
               implicit_value("")->
               default_value("crosswrench"))
+            ("lazy",
+              "install the modules of a pure python wheel as a zip that "
+              "zipimport loads",
+              cxxopts::value<bool>()->default_value("false"))
+            ("manifest",
+              "write the installed files to file as format (json mtree plain), "
+              "given as format:file",
+              cxxopts::value<std::string>()->implicit_value(""))
+            ("output", "where installed files are written (fs memory tar)",
+              cxxopts::value<std::string>()->
+              implicit_value("")->
+              default_value("fs"))
+            ("output-file", "archive to write with --output tar, - for stdout",
+              cxxopts::value<std::string>()->implicit_value(""))
             ("python",
               "path to python interpreter" + crosswrench::envdescmsg("python"),
               cxxopts::value<std::string>()->implicit_value(""))
@@ -69,9 +94,25 @@ main(int argc, char *argv[])
               cxxopts::value<std::string>()->
               implicit_value("")->
               default_value("prefix"))
+            ("skip-installed",
+              "do nothing if the wheel is installed with the same options",
+              cxxopts::value<bool>()->default_value("false"))
+            ("stdin", "read the wheel from stdin, --wheel is then its filename",
+              cxxopts::value<bool>()->default_value("false"))
+            ("store", "content-addressed store to install files from",
+              cxxopts::value<std::string>()->implicit_value(""))
+            ("store-hardlink",
+              "hardlink files from the store when reflinks are unsupported",
+              cxxopts::value<bool>()->default_value("false"))
+            ("target",
+              "also install into destdir with python and scheme, given as "
+              "python:scheme:destdir, can be used more than once",
+              cxxopts::value<std::vector<std::string>>())
+            ("uninstall", "name of distribution to uninstall",
+              cxxopts::value<std::string>()->implicit_value(""))
             ("verbose", "print files that are installed",
               cxxopts::value<bool>()->default_value("false"))
-            ("wheel", "path to wheel file",
+            ("wheel", "path to wheel file or unpacked wheel directory",
               cxxopts::value<std::string>()->implicit_value(""))
             ("license", "show license")
             ("license-libs", "show licenses of libraries used by crosswrench")
@@ -137,22 +178,68 @@ check_options(cxxopts::ParseResult &pr)
     }
 
     for (auto &opt : pr.arguments()) {
-        if (pr.count(opt.key()) != 1) {
+        if (opt.key() != "target" && pr.count(opt.key()) != 1) {
             std::cerr << "--" << opt.key() << " must be used only once"
                       << std::endl;
             areAllOptionsValid = false;
         }
     }
 
+    bool uninstall = pr.count("uninstall") != 0;
+    bool audit = pr.count("audit") != 0;
     std::vector<std::string> run_opts{ "destdir", "wheel", "python" };
     std::vector<std::string> optional_run_opts{
-        "direct-url",    "direct-url-archive", "installer",
-        "script-prefix", "script-suffix",      "scheme",
+        "direct-url",     "direct-url-archive", "dry-run",
+        "durable",        "installer",          "io-uring",
+        "lazy",           "manifest",           "output",
+        "output-file",    "script-prefix",      "script-suffix",
+        "scheme",         "skip-installed",     "stdin",
+        "store",          "store-hardlink",     "target",
         "verbose"
     };
+    std::vector<std::string> install_only_opts{
+        "direct-url",     "direct-url-archive", "durable",
+        "installer",      "io-uring",           "lazy",
+        "manifest",       "output",             "output-file",
+        "script-prefix",  "script-suffix",      "skip-installed",
+        "stdin",          "store",              "store-hardlink",
+        "target",         "wheel"
+    };
+    std::vector<std::string> uninstall_only_opts{ "dry-run" };
+    if (uninstall && audit) {
+        std::cerr << "--uninstall and --audit can not be used together"
+                  << std::endl;
+        areAllOptionsValid = false;
+    }
+    if (uninstall || audit) {
+        std::string mode = uninstall ? "uninstall" : "audit";
+        run_opts = { "destdir", mode, "python" };
+        for (auto &opt : install_only_opts) {
+            if (pr.count(opt)) {
+                std::cerr << "--" << opt << " can not be used with --" << mode
+                          << std::endl;
+                areAllOptionsValid = false;
+            }
+        }
+    }
+    if (!uninstall) {
+        for (auto &opt : uninstall_only_opts) {
+            if (pr.count(opt)) {
+                std::cerr << "--" << opt << " can only be used with --uninstall"
+                          << std::endl;
+                areAllOptionsValid = false;
+            }
+        }
+    }
     std::vector<std::string> direct_url_opts{ "direct-url",
                                               "direct-url-archive" };
     std::vector<std::string> valid_scheme_values{ "prefix", "user" };
+    std::vector<std::string> valid_output_values{ "fs", "memory", "tar" };
+    // these only apply to files written to the filesystem
+    std::vector<std::string> fs_output_opts{ "durable",        "io-uring",
+                                             "lazy",           "skip-installed",
+                                             "store",          "store-hardlink",
+                                             "target" };
 
     bool has_run_opts = false;
     for (auto &opt : run_opts) {
@@ -202,6 +289,76 @@ check_options(cxxopts::ParseResult &pr)
                 areAllOptionsValid = false;
             }
         }
+        if (pr.count("manifest")) {
+            if (pr["manifest"].as<std::string>() == "") {
+                std::cerr << "--manifest must be given a value or not used"
+                          << std::endl;
+                areAllOptionsValid = false;
+            }
+        }
+        if (pr.count("store")) {
+            if (pr["store"].as<std::string>() == "") {
+                std::cerr << "--store must be given a value or not used"
+                          << std::endl;
+                areAllOptionsValid = false;
+            }
+        }
+        else if (pr.count("store-hardlink")) {
+            std::cerr << "--store-hardlink can only be used with --store"
+                      << std::endl;
+            areAllOptionsValid = false;
+        }
+        if (pr.count("output")) {
+            std::string outputarg = pr["output"].as<std::string>();
+            if (!crosswrench::strvec_contains(valid_output_values, outputarg)) {
+                std::cerr << "--output can only be given the value fs, "
+                          << "memory or tar" << std::endl;
+                areAllOptionsValid = false;
+            }
+            else if (outputarg != "fs") {
+                for (auto &opt : fs_output_opts) {
+                    if (pr.count(opt)) {
+                        std::cerr << "--" << opt << " can not be used with "
+                                  << "--output " << outputarg << std::endl;
+                        areAllOptionsValid = false;
+                    }
+                }
+            }
+        }
+        bool tar_output =
+          pr.count("output") && pr["output"].as<std::string>() == "tar";
+        if (tar_output && (pr.count("output-file") == 0 ||
+                           pr["output-file"].as<std::string>() == ""))
+        {
+            std::cerr << "--output tar must be used with --output-file"
+                      << std::endl;
+            areAllOptionsValid = false;
+        }
+        else if (!tar_output && pr.count("output-file")) {
+            std::cerr << "--output-file can only be used with --output tar"
+                      << std::endl;
+            areAllOptionsValid = false;
+        }
+        if (pr.count("target")) {
+            for (auto &target : pr["target"].as<std::vector<std::string>>()) {
+                std::vector<std::string> parts;
+                pystring::split(target, parts, ":", 2);
+                if (parts.size() != 3 || parts[0].empty() ||
+                    parts[2].empty() ||
+                    !crosswrench::strvec_contains(valid_scheme_values,
+                                                  parts[1]))
+                {
+                    std::cerr << "--target must be given python:scheme:destdir "
+                              << "where scheme is prefix or user" << std::endl;
+                    areAllOptionsValid = false;
+                }
+            }
+            if (pr.count("manifest")) {
+                std::cerr << "--manifest can not be used with --target"
+                          << std::endl;
+                areAllOptionsValid = false;
+            }
+        }
         if (pr.count("scheme")) {
             std::string schemearg = pr["scheme"].as<std::string>();
             if (!crosswrench::strvec_contains(valid_scheme_values, schemearg)) {
@@ -0,0 +1,242 @@
+/*
+Copyright (c) 2022 Niclas Rosenvik
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "manifest.hpp"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <botan/base64.h>
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <ios>
+#include <iostream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace crosswrench {
+
+namespace {
+const std::vector<std::string> MANIFESTFORMATS{ "json", "mtree", "plain" };
+const std::vector<std::string> MTREEDIGESTS{ "sha256", "sha384", "sha512" };
+
+bool
+ismtreedigest(const std::string &hashtype)
+{
+    for (auto &d : MTREEDIGESTS) {
+        if (d == hashtype) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// RECORD has urlsafe base64 without padding, mtree and json get hex
+std::string
+hexdigest(std::string hash)
+{
+    for (auto &c : hash) {
+        c = c == '-' ? '+' : c == '_' ? '/' : c;
+    }
+    hash.append((4 - hash.size() % 4) % 4, '=');
+
+    std::string hex;
+    char buf[3];
+    for (auto b : Botan::base64_decode(hash)) {
+        std::snprintf(buf, sizeof(buf), "%02x", (unsigned int)b);
+        hex += buf;
+    }
+
+    return hex;
+}
+
+std::string
+octalmode(mode_t mode)
+{
+    char buf[8];
+    std::snprintf(buf, sizeof(buf), "%04o", (unsigned int)(mode & 07777));
+
+    return buf;
+}
+
+// whitespace, # and \ are written as \ and three octal digits
+std::string
+mtreepath(const std::string &path)
+{
+    std::string escaped{ "." };
+    char buf[5];
+    for (unsigned char c : path) {
+        if (c <= ' ' || c >= 0x7f || c == '#' || c == '\\') {
+            std::snprintf(buf, sizeof(buf), "\\%03o", (unsigned int)c);
+            escaped += buf;
+        }
+        else {
+            escaped += c;
+        }
+    }
+
+    return escaped;
+}
+
+std::string
+jsonstring(const std::string &str)
+{
+    std::string escaped{ "\"" };
+    char buf[7];
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if (c < 0x20) {
+            std::snprintf(buf, sizeof(buf), "\\u%04x", (unsigned int)c);
+            escaped += buf;
+        }
+        else {
+            escaped += c;
+        }
+    }
+    escaped += "\"";
+
+    return escaped;
+}
+} // namespace
+
+// spec is <format>:<file> where format is json, mtree or plain
+manifest::manifest(std::string spec)
+{
+    auto pos = spec.find(':');
+    if (pos != std::string::npos) {
+        format = spec.substr(0, pos);
+        filepath = spec.substr(pos + 1);
+    }
+
+    bool known = false;
+    for (auto &f : MANIFESTFORMATS) {
+        known = known || f == format;
+    }
+    if (!known || filepath.empty()) {
+        std::string msg{ "crosswrench install: invalid manifest " };
+        msg += spec;
+        msg += ", it must be json, mtree or plain followed by : and a file";
+        throw msg;
+    }
+}
+
+// path is the absolute path the file has when destdir is /, RECORD itself
+// has no hash. sha256 is only given when needssha256 is true.
+void
+manifest::add(std::string path,
+              mode_t mode,
+              std::uint64_t size,
+              std::string hashtype,
+              std::string hash,
+              std::string sha256)
+{
+    files[path] = { mode, size, hashtype, hash, sha256 };
+}
+
+// mtree only has keywords for some of the hashes RECORD can use
+bool
+manifest::needssha256(std::string hashtype)
+{
+    return format == "mtree" && !ismtreedigest(hashtype);
+}
+
+void
+manifest::write()
+{
+    std::cout << "Writing " << format << " manifest " << filepath.string()
+              << std::endl;
+
+    boost::filesystem::ofstream output{ filepath,
+                                        std::ios_base::binary |
+                                          std::ios_base::trunc };
+    if (format == "json") {
+        writejson(output);
+    }
+    else if (format == "mtree") {
+        writemtree(output);
+    }
+    else {
+        writeplain(output);
+    }
+
+    output.close();
+    if (output.fail()) {
+        std::string msg{ "crosswrench install: could not write manifest " };
+        msg += filepath.string();
+        throw msg;
+    }
+}
+
+void
+manifest::writeplain(std::ostream &output)
+{
+    for (auto &f : files) {
+        output << f.first << "\n";
+    }
+}
+
+void
+manifest::writemtree(std::ostream &output)
+{
+    output << "#mtree\n";
+    for (auto &f : files) {
+        output << mtreepath(f.first) << " type=file mode="
+               << octalmode(f.second.mode) << " size=" << f.second.size;
+        if (!f.second.hash.empty() && ismtreedigest(f.second.hashtype)) {
+            output << " " << f.second.hashtype
+                   << "digest=" << hexdigest(f.second.hash);
+        }
+        else if (!f.second.sha256.empty()) {
+            output << " sha256digest=" << hexdigest(f.second.sha256);
+        }
+        output << "\n";
+    }
+}
+
+void
+manifest::writejson(std::ostream &output)
+{
+    output << "[";
+    bool first = true;
+    for (auto &f : files) {
+        output << (first ? "\n" : ",\n") << "    { \"path\": "
+               << jsonstring(f.first) << ", \"mode\": \""
+               << octalmode(f.second.mode) << "\", \"size\": "
+               << f.second.size;
+        if (!f.second.hash.empty()) {
+            output << ", " << jsonstring(f.second.hashtype) << ": \""
+                   << hexdigest(f.second.hash) << "\"";
+        }
+        output << " }";
+        first = false;
+    }
+    output << "\n]\n";
+}
+
+} // namespace crosswrench
@@ -0,0 +1,51 @@
+#if !defined(_SRC_MANIFEST_HPP_)
+#define _SRC_MANIFEST_HPP_
+
+#include <boost/filesystem.hpp>
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+
+namespace crosswrench {
+
+// the list of installed files a package manager needs, built from what
+// crosswrench wrote instead of from a walk of destdir
+class manifest
+{
+  public:
+    manifest(std::string);
+    void add(std::string,
+             mode_t,
+             std::uint64_t,
+             std::string,
+             std::string,
+             std::string);
+    bool needssha256(std::string);
+    void write();
+
+  private:
+    struct manifestfile
+    {
+        mode_t mode;
+        std::uint64_t size;
+        std::string hashtype;
+        std::string hash;
+        std::string sha256;
+    };
+
+    void writeplain(std::ostream &);
+    void writemtree(std::ostream &);
+    void writejson(std::ostream &);
+
+    std::string format;
+    boost::filesystem::path filepath;
+    std::map<std::string, manifestfile> files;
+};
+
+} // namespace crosswrench
+
+#endif
@@ -0,0 +1,334 @@
+/*
+Copyright (c) 2022 Niclas Rosenvik
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "outfile.hpp"
+
+#include "functions.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+
+namespace crosswrench {
+
+namespace {
+const std::uint64_t COPYRANGESIZE = 16 * 1024 * 1024;
+
+// copies a range at its own offsets in both files so that several ranges
+// can be copied at the same time
+bool
+copyrange(int sourcefd,
+          int fd,
+          std::uint64_t sourceoffset,
+          std::uint64_t fileoffset,
+          std::uint64_t length)
+{
+#if defined(__linux__)
+    loff_t in = sourceoffset;
+    loff_t out = fileoffset;
+    std::uint64_t copied = 0;
+    while (copied < length) {
+        ssize_t ret =
+          copy_file_range(sourcefd, &in, fd, &out, length - copied, 0);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        copied += ret;
+    }
+
+    return true;
+#else
+    (void)sourcefd;
+    (void)fd;
+    (void)sourceoffset;
+    (void)fileoffset;
+    (void)length;
+    return false;
+#endif
+}
+
+bool
+writerange(int fd,
+           const std::uint8_t *data,
+           std::uint64_t fileoffset,
+           std::uint64_t length)
+{
+    std::uint64_t done = 0;
+    while (done < length) {
+        ssize_t ret = pwrite(fd, data + done, length - done, fileoffset + done);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        done += ret;
+    }
+
+    return true;
+}
+} // namespace
+
+outfile::outfile()
+  : fd{ -1 }
+  , preallocated{ 0 }
+  , written{ 0 }
+{}
+
+outfile::~outfile()
+{
+    if (fd != -1) {
+        ::close(fd);
+    }
+}
+
+// The file is always created so that it gets mode, a leftover file with
+// the same name is removed first. A non zero size preallocates the file,
+// this is meant for large files where it avoids fragmentation and lets the
+// filesystem allocate all extents at once.
+bool
+outfile::open(boost::filesystem::path filepath, mode_t mode, std::uint64_t size)
+{
+    int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+
+    fd = ::open(filepath.c_str(), flags, mode);
+    if (fd == -1 && errno == EEXIST && unlink(filepath.c_str()) == 0) {
+        fd = ::open(filepath.c_str(), flags, mode);
+    }
+    if (fd == -1) {
+        return false;
+    }
+
+    written = 0;
+    preallocated = 0;
+#if defined(__linux__)
+    // filesystems without support return EOPNOTSUPP, then the file is
+    // just written without preallocation
+    if (size != 0 && fallocate(fd, 0, 0, size) == 0) {
+        preallocated = size;
+    }
+#else
+    (void)size;
+#endif
+
+    return true;
+}
+
+bool
+outfile::write(const void *data, std::size_t data_size)
+{
+    const char *pos = (const char *)data;
+
+    while (data_size > 0) {
+        ssize_t ret = ::write(fd, pos, data_size);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        pos += ret;
+        data_size -= ret;
+        written += ret;
+    }
+
+    return true;
+}
+
+// makes the file share the data of another file on filesystems with
+// reflinks, false is returned if this is not possible and then nothing is
+// written
+bool
+outfile::clone(boost::filesystem::path source)
+{
+#if defined(__linux__) && defined(FICLONE)
+    int sourcefd = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (sourcefd == -1) {
+        return false;
+    }
+
+    struct stat sb;
+    bool ok = fstat(sourcefd, &sb) == 0 && ioctl(fd, FICLONE, sourcefd) == 0;
+    ::close(sourcefd);
+    if (ok) {
+        written = sb.st_size;
+        preallocated = 0;
+    }
+
+    return ok;
+#else
+    (void)source;
+    return false;
+#endif
+}
+
+// copies length bytes from offset in source to the end of the file in the
+// kernel, filesystems that can share extents or copy on the server do it
+// without the data passing through user space. False is returned if this is
+// not possible, writing the data then overwrites what was copied.
+bool
+outfile::copy(boost::filesystem::path source,
+              std::uint64_t offset,
+              std::uint64_t length)
+{
+#if defined(__linux__)
+    int sourcefd = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (sourcefd == -1) {
+        return false;
+    }
+
+    // kernels and filesystems without copy_file_range between the files
+    // still copy them with sendfile
+    off_t sourceoffset = offset;
+    std::uint64_t copied = 0;
+    bool usesendfile = false;
+    while (copied < length) {
+        ssize_t ret;
+        if (usesendfile) {
+            ret = sendfile(fd, sourcefd, &sourceoffset, length - copied);
+        }
+        else {
+            loff_t rangeoffset = sourceoffset;
+            ret = copy_file_range(
+              sourcefd, &rangeoffset, fd, nullptr, length - copied, 0);
+            sourceoffset = rangeoffset;
+        }
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret == -1 && !usesendfile) {
+            usesendfile = true;
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        copied += ret;
+    }
+    ::close(sourcefd);
+
+    // the data that is written instead of a partial copy overwrites it
+    if (copied != length) {
+        lseek(fd, written, SEEK_SET);
+        return false;
+    }
+    written += length;
+
+    return true;
+#else
+    (void)source;
+    (void)offset;
+    (void)length;
+    return false;
+#endif
+}
+
+// copies length bytes from offset in source to the end of the file in
+// ranges that are copied at the same time, a range that copy_file_range
+// can't copy is written with pwrite from data which must hold the same
+// bytes. It is meant for huge entries where one copy is bound by a single
+// thread.
+bool
+outfile::copyparallel(boost::filesystem::path source,
+                      std::uint64_t offset,
+                      std::uint64_t length,
+                      const std::uint8_t *data)
+{
+    int sourcefd = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (sourcefd == -1) {
+        return false;
+    }
+
+    std::size_t count = (length + COPYRANGESIZE - 1) / COPYRANGESIZE;
+    std::atomic<bool> ok{ true };
+    runparallel(count, [&](std::size_t i) {
+        std::uint64_t start = i * COPYRANGESIZE;
+        std::uint64_t rangelength = std::min(COPYRANGESIZE, length - start);
+        if (!copyrange(sourcefd,
+                       fd,
+                       offset + start,
+                       written + start,
+                       rangelength) &&
+            !writerange(fd, data + start, written + start, rangelength))
+        {
+            ok = false;
+        }
+    });
+    ::close(sourcefd);
+
+    if (!ok) {
+        return false;
+    }
+    written += length;
+    lseek(fd, written, SEEK_SET);
+
+    return true;
+}
+
+bool
+outfile::close()
+{
+    bool ok = true;
+
+    // the file can end up smaller than preallocated if its content was
+    // rewritten while installing
+    if (written < preallocated) {
+        ok = ftruncate(fd, written) == 0;
+    }
+
+    ok = (::close(fd) == 0) && ok;
+    fd = -1;
+
+    return ok;
+}
+
+bool
+outfile::isopen()
+{
+    return fd != -1;
+}
+
+std::uint64_t
+outfile::size()
+{
+    return written;
+}
+
+} // namespace crosswrench
@@ -0,0 +1,40 @@
+#if !defined(_SRC_OUTFILE_HPP_)
+#define _SRC_OUTFILE_HPP_
+
+#include <boost/filesystem.hpp>
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace crosswrench {
+
+class outfile
+{
+  public:
+    outfile();
+    ~outfile();
+    outfile(const outfile &) = delete;
+    outfile &operator=(const outfile &) = delete;
+    bool open(boost::filesystem::path, mode_t, std::uint64_t);
+    bool write(const void *, std::size_t);
+    bool clone(boost::filesystem::path);
+    bool copy(boost::filesystem::path, std::uint64_t, std::uint64_t);
+    bool copyparallel(boost::filesystem::path,
+                      std::uint64_t,
+                      std::uint64_t,
+                      const std::uint8_t *);
+    bool close();
+    bool isopen();
+    std::uint64_t size();
+
+  private:
+    int fd;
+    std::uint64_t preallocated;
+    std::uint64_t written;
+};
+
+} // namespace crosswrench
+
+#endif
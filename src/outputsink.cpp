@@ -0,0 +1,547 @@
+/*
+Copyright (c) 2022 Niclas Rosenvik
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "outputsink.hpp"
+
+#include "functions.hpp"
+#include "outfile.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace crosswrench {
+
+namespace {
+const std::size_t TARBLOCKSIZE = 512;
+
+// the largest size the 11 octal digits of a ustar header can hold, larger
+// files get their size in a pax header
+const std::uint64_t USTARMAXSIZE = 077777777777ULL;
+
+// the permissions in the archive do not depend on the umask
+const mode_t TARMODEMASK = 0755;
+const mode_t TARDIRMODE = 0755;
+const mode_t TARPAXMODE = 0644;
+
+void
+tarnumber(char *field, std::size_t fieldsize, std::uint64_t value)
+{
+    std::snprintf(field,
+                  fieldsize,
+                  "%0*llo",
+                  (int)fieldsize - 1,
+                  (unsigned long long)value);
+}
+
+void
+tarstring(char *field, std::size_t fieldsize, const std::string &value)
+{
+    std::memcpy(field, value.data(), std::min(fieldsize, value.size()));
+}
+
+// "<length> <key>=<value>\n" where length counts all of the record
+std::string
+paxrecord(std::string key, std::string value)
+{
+    auto rest = " " + key + "=" + value + "\n";
+    auto length = rest.size() + 1;
+    while (std::to_string(length).size() + rest.size() != length) {
+        length = std::to_string(length).size() + rest.size();
+    }
+
+    return std::to_string(length) + rest;
+}
+
+// ustar keeps paths of up to 255 bytes split at a / into a prefix of at
+// most 155 bytes and a name of at most 100 bytes
+bool
+splitustarpath(const std::string &path, std::string &prefix, std::string &name)
+{
+    if (path.size() <= 100) {
+        prefix.clear();
+        name = path;
+        return true;
+    }
+
+    auto pos = path.rfind('/', 155);
+    while (pos != std::string::npos && pos != 0) {
+        if (path.size() - pos - 1 > 100) {
+            return false;
+        }
+        if (path.size() - pos - 1 > 0) {
+            prefix = path.substr(0, pos);
+            name = path.substr(pos + 1);
+            return true;
+        }
+        pos = path.rfind('/', pos - 1);
+    }
+
+    return false;
+}
+} // namespace
+
+outputsink::~outputsink() {}
+
+bool
+outputsink::isfilesystem()
+{
+    return false;
+}
+
+// the mode a file opened with mode ends up with
+mode_t
+outputsink::filemode(mode_t mode)
+{
+    return mode;
+}
+
+// called when all files have been written
+void
+outputsink::finish()
+{}
+
+fssink::fssink()
+  : mask{ umask(0) }
+{
+    umask(mask);
+}
+
+// creates the directory of filepath, another install can create the same
+// directories at the same time
+void
+fssink::createdirs(boost::filesystem::path filepath)
+{
+    boost::filesystem::path dirpath = filepath;
+    dirpath.remove_filename();
+    if (createddirs.count(dirpath) == 0) {
+        boost::system::error_code ec;
+        boost::filesystem::create_directories(dirpath, ec);
+        if (ec && !boost::filesystem::is_directory(dirpath)) {
+            std::string msg{ "crosswrench install: could not create " };
+            msg += dirpath.string();
+            msg += ": ";
+            msg += ec.message();
+            throw msg;
+        }
+        createddirs.insert(dirpath);
+    }
+}
+
+bool
+fssink::open(boost::filesystem::path filepath, mode_t mode, std::uint64_t size)
+{
+    if (file.isopen()) {
+        file.close();
+    }
+
+    return file.open(filepath, mode, size);
+}
+
+bool
+fssink::write(const void *data, std::size_t data_size)
+{
+    return file.write(data, data_size);
+}
+
+bool
+fssink::close()
+{
+    return file.close();
+}
+
+bool
+fssink::isopen()
+{
+    return file.isopen();
+}
+
+std::uint64_t
+fssink::size()
+{
+    return file.size();
+}
+
+bool
+fssink::isfilesystem()
+{
+    return true;
+}
+
+mode_t
+fssink::filemode(mode_t mode)
+{
+    return mode & ~mask;
+}
+
+// keeps the path, mode and content of every file in memory, installing to
+// it measures inflating, hashing and planning without any disk writes
+memorysink::memorysink()
+  : opened{ false }
+{}
+
+void
+memorysink::createdirs(boost::filesystem::path)
+{}
+
+bool
+memorysink::open(boost::filesystem::path filepath,
+                 mode_t mode,
+                 std::uint64_t size)
+{
+    memoryfiles.push_back({ filepath, mode, std::string{} });
+    memoryfiles.back().data.reserve(size);
+    opened = true;
+
+    return true;
+}
+
+bool
+memorysink::write(const void *data, std::size_t data_size)
+{
+    if (!opened) {
+        return false;
+    }
+    memoryfiles.back().data.append((const char *)data, data_size);
+
+    return true;
+}
+
+bool
+memorysink::close()
+{
+    bool wasopen = opened;
+    opened = false;
+
+    return wasopen;
+}
+
+bool
+memorysink::isopen()
+{
+    return opened;
+}
+
+std::uint64_t
+memorysink::size()
+{
+    return memoryfiles.empty() ? 0 : memoryfiles.back().data.size();
+}
+
+void
+memorysink::finish()
+{
+    std::uint64_t total = 0;
+    for (auto &f : memoryfiles) {
+        total += f.data.size();
+    }
+    std::cout << "Wrote " << memoryfiles.size() << " files of " << total
+              << " bytes to memory" << std::endl;
+}
+
+const std::vector<memorysink::memoryfile> &
+memorysink::files()
+{
+    return memoryfiles;
+}
+
+// paths in the archive are relative to root, every file gets the mtime
+// from SOURCE_DATE_EPOCH and is owned by root so that the same install
+// gives the same archive
+tarsink::tarsink(std::string _filename, boost::filesystem::path _root)
+  : filename{ _filename }
+  , root{ _root.lexically_normal() }
+  , fd{ -1 }
+  , mtime{ sourcedateepoch() }
+  , openmode{ 0 }
+  , opened{ false }
+  , streaming{ false }
+  , streamsize{ 0 }
+  , streamed{ 0 }
+{
+    if (filename == "-") {
+        fd = STDOUT_FILENO;
+        return;
+    }
+
+    fd = ::open(
+      filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        std::string msg{ "crosswrench install: could not open " };
+        msg += filename;
+        msg += ": ";
+        msg += std::strerror(errno);
+        throw msg;
+    }
+}
+
+tarsink::~tarsink()
+{
+    if (fd != -1 && fd != STDOUT_FILENO) {
+        ::close(fd);
+    }
+}
+
+void
+tarsink::createdirs(boost::filesystem::path)
+{}
+
+// A file with a known size has its header written at once and its data
+// written to the archive as it arrives. The size is only known when the
+// file is closed if it is not given, #!python is rewritten in scripts, the
+// content is then kept until then.
+bool
+tarsink::open(boost::filesystem::path filepath,
+              mode_t mode,
+              std::uint64_t size)
+{
+    auto relpath = filepath.lexically_normal().lexically_relative(root);
+    if (relpath.empty() || *relpath.begin() == "..") {
+        return false;
+    }
+
+    openpath = relpath.generic_string();
+    openmode = mode;
+    data.clear();
+    streaming = size != 0;
+    streamsize = size;
+    streamed = 0;
+    if (streaming &&
+        !(adddirs(openpath) &&
+          writeheader(openpath, '0', filemode(openmode), streamsize)))
+    {
+        return false;
+    }
+    opened = true;
+
+    return true;
+}
+
+bool
+tarsink::write(const void *_data, std::size_t data_size)
+{
+    if (!opened) {
+        return false;
+    }
+    if (streaming) {
+        if (data_size > streamsize - streamed ||
+            !writeall((const char *)_data, data_size))
+        {
+            return false;
+        }
+        streamed += data_size;
+        return true;
+    }
+    data.append((const char *)_data, data_size);
+
+    return true;
+}
+
+// a streamed file that got another size than its header says leaves the
+// archive broken, the install fails
+bool
+tarsink::close()
+{
+    if (!opened) {
+        return false;
+    }
+    opened = false;
+
+    if (streaming) {
+        std::array<char, TARBLOCKSIZE> padding{};
+        return streamed == streamsize &&
+               writeall(padding.data(),
+                        (TARBLOCKSIZE - streamsize % TARBLOCKSIZE) %
+                          TARBLOCKSIZE);
+    }
+
+    return adddirs(openpath) &&
+           addmember(openpath, '0', filemode(openmode), data);
+}
+
+bool
+tarsink::isopen()
+{
+    return opened;
+}
+
+std::uint64_t
+tarsink::size()
+{
+    return streaming ? streamed : data.size();
+}
+
+mode_t
+tarsink::filemode(mode_t mode)
+{
+    return mode & TARMODEMASK;
+}
+
+// the archive ends with two blocks of zeros
+void
+tarsink::finish()
+{
+    std::array<char, 2 * TARBLOCKSIZE> end{};
+    bool ok = writeblocks(end.data(), end.size());
+    if (fd != STDOUT_FILENO) {
+        ok = (::close(fd) == 0) && ok;
+        fd = -1;
+    }
+    if (!ok) {
+        std::string msg{ "crosswrench install: could not write to " };
+        msg += filename;
+        throw msg;
+    }
+}
+
+// directories are added before the first file in them
+bool
+tarsink::adddirs(std::string path)
+{
+    std::vector<std::string> dirs;
+    auto pos = path.rfind('/');
+    while (pos != std::string::npos) {
+        path.resize(pos);
+        if (addeddirs.count(path) == 1) {
+            break;
+        }
+        dirs.push_back(path);
+        pos = path.rfind('/');
+    }
+
+    for (auto d = dirs.rbegin(); d != dirs.rend(); ++d) {
+        if (!addmember(*d + "/", '5', TARDIRMODE, std::string{})) {
+            return false;
+        }
+        addeddirs.insert(*d);
+    }
+
+    return true;
+}
+
+bool
+tarsink::addmember(std::string path,
+                   char type,
+                   mode_t mode,
+                   const std::string &content)
+{
+    return writeheader(path, type, mode, content.size()) &&
+           writeblocks(content.data(), content.size());
+}
+
+// a pax header goes before the ustar header when the path or the size
+// does not fit in it
+bool
+tarsink::writeheader(std::string path,
+                     char type,
+                     mode_t mode,
+                     std::uint64_t size)
+{
+    std::string prefix;
+    std::string name;
+    std::string pax;
+    if (!splitustarpath(path, prefix, name)) {
+        pax += paxrecord("path", path);
+        prefix.clear();
+        name = path.substr(0, 100);
+    }
+    if (size > USTARMAXSIZE) {
+        pax += paxrecord("size", std::to_string(size));
+    }
+    if (!pax.empty() &&
+        !addmember("PaxHeaders/" + name.substr(0, 89), 'x', TARPAXMODE, pax))
+    {
+        return false;
+    }
+
+    std::array<char, TARBLOCKSIZE> header{};
+    tarstring(&header[0], 100, name);
+    tarnumber(&header[100], 8, mode);
+    tarnumber(&header[108], 8, 0);
+    tarnumber(&header[116], 8, 0);
+    tarnumber(&header[124], 12, size > USTARMAXSIZE ? 0 : size);
+    tarnumber(&header[136], 12, mtime);
+    header[156] = type;
+    tarstring(&header[257], 6, std::string{ "ustar", 6 });
+    tarstring(&header[263], 2, "00");
+    tarstring(&header[265], 32, "root");
+    tarstring(&header[297], 32, "root");
+    tarnumber(&header[329], 8, 0);
+    tarnumber(&header[337], 8, 0);
+    tarstring(&header[345], 155, prefix);
+
+    // the checksum is calculated with its own field set to spaces
+    std::memset(&header[148], ' ', 8);
+    unsigned int checksum = 0;
+    for (auto c : header) {
+        checksum += (unsigned char)c;
+    }
+    tarnumber(&header[148], 7, checksum);
+
+    return writeblocks(header.data(), header.size());
+}
+
+// data is padded with zeros to a multiple of the block size
+bool
+tarsink::writeblocks(const char *blockdata, std::size_t data_size)
+{
+    std::array<char, TARBLOCKSIZE> padding{};
+    auto paddingsize = (TARBLOCKSIZE - data_size % TARBLOCKSIZE) % TARBLOCKSIZE;
+
+    return writeall(blockdata, data_size) &&
+           writeall(padding.data(), paddingsize);
+}
+
+bool
+tarsink::writeall(const char *writedata, std::size_t data_size)
+{
+    while (data_size > 0) {
+        ssize_t ret = ::write(fd, writedata, data_size);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        writedata += ret;
+        data_size -= ret;
+    }
+
+    return true;
+}
+
+} // namespace crosswrench
@@ -0,0 +1,119 @@
+#if !defined(_SRC_OUTPUTSINK_HPP_)
+#define _SRC_OUTPUTSINK_HPP_
+
+#include "outfile.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace crosswrench {
+
+// where spread writes the installed files, one file is open at a time
+class outputsink
+{
+  public:
+    virtual ~outputsink();
+    virtual void createdirs(boost::filesystem::path) = 0;
+    virtual bool open(boost::filesystem::path, mode_t, std::uint64_t) = 0;
+    virtual bool write(const void *, std::size_t) = 0;
+    virtual bool close() = 0;
+    virtual bool isopen() = 0;
+    virtual std::uint64_t size() = 0;
+    virtual bool isfilesystem();
+    virtual mode_t filemode(mode_t);
+    virtual void finish();
+};
+
+class fssink : public outputsink
+{
+  public:
+    fssink();
+    void createdirs(boost::filesystem::path) override;
+    bool open(boost::filesystem::path, mode_t, std::uint64_t) override;
+    bool write(const void *, std::size_t) override;
+    bool close() override;
+    bool isopen() override;
+    std::uint64_t size() override;
+    bool isfilesystem() override;
+    mode_t filemode(mode_t) override;
+
+  private:
+    outfile file;
+    mode_t mask;
+    std::set<boost::filesystem::path> createddirs;
+};
+
+class memorysink : public outputsink
+{
+  public:
+    struct memoryfile
+    {
+        boost::filesystem::path path;
+        mode_t mode;
+        std::string data;
+    };
+
+    memorysink();
+    void createdirs(boost::filesystem::path) override;
+    bool open(boost::filesystem::path, mode_t, std::uint64_t) override;
+    bool write(const void *, std::size_t) override;
+    bool close() override;
+    bool isopen() override;
+    std::uint64_t size() override;
+    void finish() override;
+    const std::vector<memoryfile> &files();
+
+  private:
+    std::vector<memoryfile> memoryfiles;
+    bool opened;
+};
+
+// writes the files as a ustar archive with pax headers for long paths and
+// large files, to stdout if the filename is -
+class tarsink : public outputsink
+{
+  public:
+    tarsink(std::string, boost::filesystem::path);
+    ~tarsink();
+    tarsink(const tarsink &) = delete;
+    tarsink &operator=(const tarsink &) = delete;
+    void createdirs(boost::filesystem::path) override;
+    bool open(boost::filesystem::path, mode_t, std::uint64_t) override;
+    bool write(const void *, std::size_t) override;
+    bool close() override;
+    bool isopen() override;
+    std::uint64_t size() override;
+    mode_t filemode(mode_t) override;
+    void finish() override;
+
+  private:
+    bool adddirs(std::string);
+    bool addmember(std::string, char, mode_t, const std::string &);
+    bool writeheader(std::string, char, mode_t, std::uint64_t);
+    bool writeblocks(const char *, std::size_t);
+    bool writeall(const char *, std::size_t);
+
+    std::string filename;
+    boost::filesystem::path root;
+    int fd;
+    std::int64_t mtime;
+    std::set<std::string> addeddirs;
+    std::string openpath;
+    mode_t openmode;
+    std::string data;
+    bool opened;
+    bool streaming;
+    std::uint64_t streamsize;
+    std::uint64_t streamed;
+};
+
+} // namespace crosswrench
+
+#endif
@@ -0,0 +1,516 @@
+/*
+Copyright (c) 2022 Niclas Rosenvik
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "ownerindex.hpp"
+
+#include "functions.hpp"
+#include "outfile.hpp"
+#include "record.hpp"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <pystring.h>
+
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace crosswrench {
+
+// The index maps every path in the RECORD files in purelib and platlib to
+// the .dist-info directory it belongs to. It is an open addressing hash
+// table that is used directly from the mapped file:
+//
+//   indexheader
+//   indexowner[nowners]     one per .dist-info directory
+//   indexbucket[nbuckets]   nbuckets is a power of two, hash 0 is empty
+//   strings                 nul terminated, paths are relative to destdir
+//
+// An owner keeps the mtime, size and inode of its RECORD, the index is
+// rebuilt from the RECORD files when they don't match the installed
+// .dist-info directories.
+namespace {
+const char INDEXMAGIC[8] = { 'C', 'W', 'I', 'N', 'D', 'E', 'X', '1' };
+const std::uint64_t INDEXBYTEORDER = 0x0102030405060708;
+const std::uint64_t MINBUCKETS = 16;
+
+struct indexheader
+{
+    char magic[8];
+    std::uint64_t byteorder;
+    std::uint64_t nowners;
+    std::uint64_t ownersoffset;
+    std::uint64_t nbuckets;
+    std::uint64_t bucketsoffset;
+    std::uint64_t stringsoffset;
+    std::uint64_t stringssize;
+};
+
+struct indexowner
+{
+    std::uint64_t nameoffset;
+    std::uint64_t mtime;
+    std::uint64_t size;
+    std::uint64_t inode;
+};
+
+struct indexbucket
+{
+    std::uint64_t hash;
+    std::uint32_t pathoffset;
+    std::uint32_t owner;
+};
+
+// FNV-1a, 0 marks an empty bucket so it is never returned
+std::uint64_t
+pathhash(const std::string &key)
+{
+    std::uint64_t hash = 0xcbf29ce484222325;
+    for (unsigned char c : key) {
+        hash ^= c;
+        hash *= 0x100000001b3;
+    }
+
+    return hash == 0 ? 1 : hash;
+}
+
+std::string
+ownername(const std::string &distinfo)
+{
+    std::vector<std::string> parts;
+    auto dirname = boost::filesystem::path{ distinfo }.filename().string();
+    pystring::split(dirname, parts, "-");
+
+    return normalizedistname(parts.at(0));
+}
+} // namespace
+
+ownerindex::ownerindex(boost::filesystem::path _destdir)
+  : destdir{ _destdir.lexically_normal() }
+  , indexpath{ destdir / rootinstalldir(true) / ".crosswrench.index" }
+  , data{ nullptr }
+  , datasize{ 0 }
+{}
+
+ownerindex::~ownerindex()
+{
+    unmap();
+}
+
+// the owners of the distribution name are not compared with the
+// installed .dist-info directories, this is the distribution that is being
+// installed or uninstalled and update is called for it
+void
+ownerindex::load(std::string name)
+{
+    if (map() && isvalid(name)) {
+        return;
+    }
+
+    unmap();
+    rebuild();
+    if (!map()) {
+        std::string msg{ "crosswrench: could not read " };
+        msg += indexpath.string();
+        throw msg;
+    }
+}
+
+// the .dist-info directory that has filepath in its RECORD or an empty
+// string
+std::string
+ownerindex::owner(const boost::filesystem::path &filepath)
+{
+    if (data == nullptr) {
+        return std::string{};
+    }
+
+    auto key = indexkey(filepath);
+    if (key.empty()) {
+        return std::string{};
+    }
+
+    auto header = (const indexheader *)data;
+    auto owners = (const indexowner *)(data + header->ownersoffset);
+    auto buckets = (const indexbucket *)(data + header->bucketsoffset);
+    auto strings = data + header->stringsoffset;
+    auto hash = pathhash(key);
+    auto mask = header->nbuckets - 1;
+
+    // a table without an empty bucket only comes from a damaged index,
+    // it is probed once around and the path counts as not owned
+    auto i = hash & mask;
+    for (std::uint64_t probe = 0; probe < header->nbuckets;
+         probe++, i = (i + 1) & mask)
+    {
+        auto &bucket = buckets[i];
+        if (bucket.hash == 0) {
+            return std::string{};
+        }
+        if (bucket.hash == hash && bucket.pathoffset < header->stringssize &&
+            key == strings + bucket.pathoffset &&
+            bucket.owner < header->nowners)
+        {
+            auto &o = owners[bucket.owner];
+            return boost::filesystem::path{ strings + o.nameoffset }
+              .filename()
+              .string();
+        }
+    }
+
+    return std::string{};
+}
+
+// the owners of the distribution name are replaced with distinfo, an
+// empty distinfo just removes them, and the index is written anew
+void
+ownerindex::update(std::string name, boost::filesystem::path distinfo)
+{
+    load(name);
+
+    auto normalname = normalizedistname(name);
+    auto header = (const indexheader *)data;
+    auto owners = (const indexowner *)(data + header->ownersoffset);
+    auto buckets = (const indexbucket *)(data + header->bucketsoffset);
+    auto strings = data + header->stringsoffset;
+
+    std::vector<owner_t> newowners;
+    std::vector<std::pair<std::string, std::uint32_t>> entries;
+    std::map<std::uint32_t, std::uint32_t> kept;
+    for (std::uint32_t i = 0; i < header->nowners; i++) {
+        std::string distinfoname{ strings + owners[i].nameoffset };
+        if (ownername(distinfoname) != normalname) {
+            kept[i] = newowners.size();
+            newowners.push_back({ distinfoname,
+                                  owners[i].mtime,
+                                  owners[i].size,
+                                  owners[i].inode });
+        }
+    }
+    for (std::uint64_t i = 0; i < header->nbuckets; i++) {
+        auto &bucket = buckets[i];
+        if (bucket.hash != 0 && kept.count(bucket.owner) == 1) {
+            entries.emplace_back(strings + bucket.pathoffset,
+                                 kept[bucket.owner]);
+        }
+    }
+
+    if (!distinfo.empty()) {
+        addowner(distinfo, newowners, entries);
+    }
+
+    unmap();
+    write(newowners, entries);
+    map();
+}
+
+bool
+ownerindex::map()
+{
+    int fd = open(indexpath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || (std::size_t)sb.st_size < sizeof(indexheader)) {
+        close(fd);
+        return false;
+    }
+
+    void *mapped = mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    data = (const char *)mapped;
+    datasize = sb.st_size;
+
+    // everything the lookups use has to be inside the file
+    auto header = (const indexheader *)data;
+    bool valid =
+      std::memcmp(header->magic, INDEXMAGIC, sizeof(INDEXMAGIC)) == 0 &&
+      header->byteorder == INDEXBYTEORDER && header->nbuckets != 0 &&
+      (header->nbuckets & (header->nbuckets - 1)) == 0 &&
+      header->ownersoffset <= datasize &&
+      header->nowners <=
+        (datasize - header->ownersoffset) / sizeof(indexowner) &&
+      header->bucketsoffset <= datasize &&
+      header->nbuckets <=
+        (datasize - header->bucketsoffset) / sizeof(indexbucket) &&
+      header->stringsoffset <= datasize && header->stringssize != 0 &&
+      header->stringssize <= datasize - header->stringsoffset &&
+      data[header->stringsoffset + header->stringssize - 1] == '\0';
+    if (valid) {
+        auto owners = (const indexowner *)(data + header->ownersoffset);
+        for (std::uint64_t i = 0; i < header->nowners; i++) {
+            valid = valid && owners[i].nameoffset < header->stringssize;
+        }
+        auto buckets = (const indexbucket *)(data + header->bucketsoffset);
+        for (std::uint64_t i = 0; i < header->nbuckets; i++) {
+            valid = valid && (buckets[i].hash == 0 ||
+                              (buckets[i].pathoffset < header->stringssize &&
+                               buckets[i].owner < header->nowners));
+        }
+    }
+    if (!valid) {
+        unmap();
+    }
+
+    return valid;
+}
+
+void
+ownerindex::unmap()
+{
+    if (data != nullptr) {
+        munmap((void *)data, datasize);
+        data = nullptr;
+        datasize = 0;
+    }
+}
+
+// only the RECORD files are stat:ed, none of them is read
+bool
+ownerindex::isvalid(std::string name)
+{
+    auto normalname = normalizedistname(name);
+    auto header = (const indexheader *)data;
+    auto owners = (const indexowner *)(data + header->ownersoffset);
+    auto strings = data + header->stringsoffset;
+
+    auto installed = installedowners();
+    std::size_t matched = 0;
+    for (std::uint64_t i = 0; i < header->nowners; i++) {
+        std::string distinfo{ strings + owners[i].nameoffset };
+        if (ownername(distinfo) == normalname) {
+            continue;
+        }
+        auto o = installed.find(distinfo);
+        if (o == installed.end() || o->second.mtime != owners[i].mtime ||
+            o->second.size != owners[i].size ||
+            o->second.inode != owners[i].inode)
+        {
+            return false;
+        }
+        matched++;
+    }
+
+    for (auto &o : installed) {
+        if (ownername(o.first) != normalname) {
+            matched--;
+        }
+    }
+
+    return matched == 0;
+}
+
+void
+ownerindex::rebuild()
+{
+    std::cout << "Building " << indexpath.string() << std::endl;
+    std::vector<owner_t> owners;
+    std::vector<std::pair<std::string, std::uint32_t>> entries;
+
+    for (auto &o : installedowners()) {
+        addowner(destdir / o.first, owners, entries);
+    }
+
+    write(owners, entries);
+}
+
+void
+ownerindex::addowner(
+  boost::filesystem::path distinfo,
+  std::vector<owner_t> &owners,
+  std::vector<std::pair<std::string, std::uint32_t>> &entries)
+{
+    auto recordpath = distinfo / "RECORD";
+    struct stat sb;
+    if (stat(recordpath.c_str(), &sb) != 0) {
+        return;
+    }
+
+    std::uint32_t ownerindex = owners.size();
+    owners.push_back({ indexkey(distinfo),
+                       (std::uint64_t)sb.st_mtime,
+                       (std::uint64_t)sb.st_size,
+                       (std::uint64_t)sb.st_ino });
+
+    boost::filesystem::ifstream input_p{ recordpath, std::ios_base::binary };
+    std::stringstream content;
+    content << input_p.rdbuf();
+
+    // an owner with a RECORD that can't be parsed owns no paths
+    try {
+        record installed{ content.str(), true };
+        for (auto &f : installed.files()) {
+            auto key = indexkey(distinfo.parent_path() / f);
+            if (!key.empty()) {
+                entries.emplace_back(key, ownerindex);
+            }
+        }
+    }
+    catch (std::string s) {
+        return;
+    }
+}
+
+// the index is written next to its final path and renamed into place, the
+// first owner of a path that is in several RECORD files keeps it
+void
+ownerindex::write(
+  const std::vector<owner_t> &owners,
+  const std::vector<std::pair<std::string, std::uint32_t>> &entries)
+{
+    std::uint64_t nbuckets = MINBUCKETS;
+    while (nbuckets < entries.size() * 2) {
+        nbuckets *= 2;
+    }
+
+    std::string strings;
+    std::vector<indexowner> indexowners;
+    for (auto &o : owners) {
+        indexowners.push_back({ strings.size(), o.mtime, o.size, o.inode });
+        strings += o.distinfo;
+        strings += '\0';
+    }
+
+    std::vector<indexbucket> buckets(nbuckets, indexbucket{ 0, 0, 0 });
+    auto mask = nbuckets - 1;
+    for (auto &e : entries) {
+        auto hash = pathhash(e.first);
+        auto i = hash & mask;
+        bool duplicate = false;
+        while (buckets[i].hash != 0 && !duplicate) {
+            duplicate = buckets[i].hash == hash &&
+                        e.first == strings.c_str() + buckets[i].pathoffset;
+            i = (i + 1) & mask;
+        }
+        if (duplicate) {
+            continue;
+        }
+        if (strings.size() > UINT32_MAX) {
+            std::string msg{ "crosswrench: too many paths for " };
+            msg += indexpath.string();
+            throw msg;
+        }
+        buckets[i] = { hash, (std::uint32_t)strings.size(), e.second };
+        strings += e.first;
+        strings += '\0';
+    }
+    if (strings.empty()) {
+        strings += '\0';
+    }
+
+    indexheader header;
+    std::memcpy(header.magic, INDEXMAGIC, sizeof(INDEXMAGIC));
+    header.byteorder = INDEXBYTEORDER;
+    header.nowners = indexowners.size();
+    header.ownersoffset = sizeof(indexheader);
+    header.nbuckets = nbuckets;
+    header.bucketsoffset =
+      header.ownersoffset + indexowners.size() * sizeof(indexowner);
+    header.stringsoffset =
+      header.bucketsoffset + buckets.size() * sizeof(indexbucket);
+    header.stringssize = strings.size();
+
+    auto tmppath = indexpath.parent_path();
+    tmppath /= "." + indexpath.filename().string() + ".crosswrench-" +
+               std::to_string(getpid());
+    outfile output_p;
+    if (!output_p.open(tmppath, 0666, 0) ||
+        !output_p.write(&header, sizeof(header)) ||
+        !output_p.write(indexowners.data(),
+                        indexowners.size() * sizeof(indexowner)) ||
+        !output_p.write(buckets.data(), buckets.size() * sizeof(indexbucket)) ||
+        !output_p.write(strings.data(), strings.size()) || !output_p.close())
+    {
+        boost::system::error_code ec;
+        boost::filesystem::remove(tmppath, ec);
+        std::string msg{ "crosswrench: could not write " };
+        msg += tmppath.string();
+        throw msg;
+    }
+
+    boost::filesystem::rename(tmppath, indexpath);
+}
+
+// the .dist-info directories with a RECORD in purelib and platlib
+std::map<std::string, ownerindex::owner_t>
+ownerindex::installedowners()
+{
+    std::map<std::string, owner_t> owners;
+
+    for (auto &root : installroots(destdir)) {
+        boost::system::error_code ec;
+        for (boost::filesystem::directory_iterator i{ root, ec }, end;
+             !ec && i != end;
+             i.increment(ec))
+        {
+            auto recordpath = i->path() / "RECORD";
+            struct stat sb;
+            if (!pystring::endswith(i->path().filename().string(),
+                                    ".dist-info") ||
+                stat(recordpath.c_str(), &sb) != 0)
+            {
+                continue;
+            }
+
+            auto distinfo = indexkey(i->path());
+            owners[distinfo] = { distinfo,
+                                 (std::uint64_t)sb.st_mtime,
+                                 (std::uint64_t)sb.st_size,
+                                 (std::uint64_t)sb.st_ino };
+        }
+    }
+
+    return owners;
+}
+
+// paths are kept relative to destdir, paths outside of it are not indexed
+std::string
+ownerindex::indexkey(const boost::filesystem::path &filepath)
+{
+    auto relpath = filepath.lexically_normal().lexically_relative(destdir);
+    if (relpath.empty() || *relpath.begin() == "..") {
+        return std::string{};
+    }
+
+    return relpath.generic_string();
+}
+
+} // namespace crosswrench
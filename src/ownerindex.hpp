@@ -0,0 +1,55 @@
+#if !defined(_SRC_OWNERINDEX_HPP_)
+#define _SRC_OWNERINDEX_HPP_
+
+#include <boost/filesystem.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace crosswrench {
+
+class ownerindex
+{
+  public:
+    ownerindex(boost::filesystem::path);
+    ~ownerindex();
+    ownerindex(const ownerindex &) = delete;
+    ownerindex &operator=(const ownerindex &) = delete;
+    void load(std::string);
+    std::string owner(const boost::filesystem::path &);
+    void update(std::string, boost::filesystem::path);
+
+  private:
+    struct owner_t
+    {
+        std::string distinfo;
+        std::uint64_t mtime;
+        std::uint64_t size;
+        std::uint64_t inode;
+    };
+
+    bool map();
+    void unmap();
+    bool isvalid(std::string);
+    void rebuild();
+    void addowner(boost::filesystem::path,
+                  std::vector<owner_t> &,
+                  std::vector<std::pair<std::string, std::uint32_t>> &);
+    void write(const std::vector<owner_t> &,
+               const std::vector<std::pair<std::string, std::uint32_t>> &);
+    std::map<std::string, owner_t> installedowners();
+    std::string indexkey(const boost::filesystem::path &);
+
+    boost::filesystem::path destdir;
+    boost::filesystem::path indexpath;
+    const char *data;
+    std::size_t datasize;
+};
+
+} // namespace crosswrench
+
+#endif
@@ -51,6 +51,12 @@ const int RFILESIZE = 2;
 } // namespace
 
 record::record(std::string content)
+  : record(content, false)
+{}
+
+// An installed RECORD can have rows without hash and size, like the ones
+// for .pyc files and for RECORD itself in another .dist-info directory.
+record::record(std::string content, bool installed)
 {
     // normalize EOL:s
     std::vector<std::string> content_result;
@@ -64,6 +70,7 @@ record::record(std::string content)
       csvr;
 
     if (csvr.parse(content)) {
+        hashlib2botan h2b;
         for (const auto row : csvr) {
             std::array<std::string, 4> from_csv = { "", "", "", "" };
             std::string filepath;
@@ -71,7 +78,8 @@ record::record(std::string content)
             auto firstcell = *celliter;
             firstcell.read_value(filepath);
 
-            if (filepath == (dotdistinfodir() + "/RECORD")) {
+            // an installed RECORD is not read with --wheel
+            if (!installed && filepath == (dotdistinfodir() + "/RECORD")) {
                 // the RECORD file itself, special case
                 from_csv[0] = filepath;
             }
@@ -85,8 +93,10 @@ record::record(std::string content)
                         case 1: {
                             std::vector<std::string> result;
                             std::string c_value;
-                            hashlib2botan h2b;
                             cell.read_value(c_value);
+                            if (installed && c_value.empty()) {
+                                break;
+                            }
                             pystring::partition(c_value, "=", result);
                             if (result[1].empty()) {
                                 throw std::string("Record invalid, invalid "
@@ -111,6 +121,9 @@ record::record(std::string content)
                         case 2: {
                             std::string file_size;
                             cell.read_value(file_size);
+                            if (installed && file_size.empty()) {
+                                break;
+                            }
                             if (!pystring::isdigit(file_size)) {
                                 throw std::string(
                                   "RECORD invalid, size cell do") +
@@ -126,6 +139,9 @@ record::record(std::string content)
                     cell_index++;
                 }
             }
+            if (installed) {
+                from_csv[0] = pystring::strip(from_csv[0], "\"");
+            }
             if (records.count(from_csv[0]) == 1) {
                 throw std::string(
                   "RECORD contains the same file multiple times");
@@ -142,9 +158,19 @@ record::record(std::string content)
 }
 
 bool
-record::verify(libzippp::ZipArchive &ar)
+record::verify(wheelsource &ar)
+{
+    return verify(ar, {});
+}
+
+// Entries in streamed were hashed when the wheel was read from a stream,
+// they are only read again when RECORD uses another hash type for them.
+bool
+record::verify(
+  wheelsource &ar,
+  const std::map<std::string, std::array<std::string, 3>> &streamed)
 {
-    std::vector<libzippp::ZipEntry> wentries = ar.getEntries();
+    std::vector<wheelentry> wentries = ar.inarchiveorder();
     hashlib2botan h2b;
 
     for (auto &i : records) {
@@ -167,6 +193,23 @@ record::verify(libzippp::ZipArchive &ar)
         }
 
         auto re = records.at(we.getName());
+        auto streamedentry = streamed.find(we.getName());
+        if (streamedentry != streamed.end() &&
+            streamedentry->second.at(RHASHTYPE) == re.at(RHASHTYPE))
+        {
+            if (we.getSize() != std::stoul(re.at(RFILESIZE))) {
+                std::cerr << "File size of " << we.getName()
+                          << " and the one in RECORD don't match" << std::endl;
+                return false;
+            }
+            if (streamedentry->second.at(RHASHVALUE) != re.at(RHASHVALUE)) {
+                std::cerr << "Hash of " << we.getName() << " RECORD don't match"
+                          << std::endl;
+                return false;
+            }
+            continue;
+        }
+
         auto hasher =
           Botan::HashFunction::create(h2b.hashname(re.at(RHASHTYPE)));
 
@@ -222,24 +265,69 @@ record::add(std::string filepath,
     return false;
 }
 
+// an install is committed with RECORD, one that is not completely written
+// must fail it
 void
-record::write(bool rootispurelib, boost::filesystem::path destdir)
+record::write(boost::filesystem::path filename)
 {
     std::ofstream out;
-    boost::filesystem::path filename = destdir;
-    filename /= rootinstalldir(rootispurelib);
-    filename /= dotdistinfodir();
-    filename /= "RECORD";
     out.open(filename.string(), std::ios_base::binary | std::ios_base::out);
-    csv2::Writer<csv2::delimiter<','>> csv_w{ out };
+    write(out);
+    bool written = out.good();
+    out.close();
+    if (!written || out.fail()) {
+        std::string msg{ "crosswrench install: could not write " };
+        msg += filename.string();
+        throw msg;
+    }
+}
+
+// rows are written the way csv2::Writer writes them, without quoting, so
+// RECORD can go to any stream
+void
+record::write(std::ostream &out)
+{
+    for (auto &r : records) {
+        out << r.first << ","
+            << (r.second.at(RHASHTYPE).empty()
+                  ? ""
+                  : r.second.at(RHASHTYPE) + "=" + r.second.at(RHASHVALUE))
+            << "," << r.second.at(RFILESIZE) << "\n";
+    }
+}
+
+bool
+record::contains(std::string filepath)
+{
+    return records.count(filepath) == 1;
+}
+
+std::string
+record::hashtype(std::string filepath)
+{
+    return records.at(filepath).at(RHASHTYPE);
+}
+
+std::string
+record::hash(std::string filepath)
+{
+    return records.at(filepath).at(RHASHVALUE);
+}
+
+std::string
+record::filesize(std::string filepath)
+{
+    return records.at(filepath).at(RFILESIZE);
+}
+
+std::vector<std::string>
+record::files()
+{
+    std::vector<std::string> filepaths;
     for (auto &r : records) {
-        std::array<std::string, 3> content{ r.first,
-                                            r.second.at(RHASHTYPE).empty()
-                                              ? ""
-                                              : r.second.at(RHASHTYPE) + "=" +
-                                                  r.second.at(RHASHVALUE),
-                                            r.second.at(RFILESIZE) };
-        csv_w.write_row(content);
+        filepaths.push_back(r.first);
     }
+
+    return filepaths;
 }
 } // namespace crosswrench
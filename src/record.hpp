@@ -1,12 +1,15 @@
 #if !defined(_SRC_RECORD_HPP_)
 #define _SRC_RECORD_HPP_
 
+#include "wheelsource.hpp"
+
 #include <boost/filesystem.hpp>
-#include <libzippp.h>
 
 #include <array>
 #include <map>
+#include <ostream>
 #include <string>
+#include <vector>
 
 namespace crosswrench {
 
@@ -15,9 +18,18 @@ class record
   public:
     record() = delete;
     record(std::string);
-    bool verify(libzippp::ZipArchive &);
+    record(std::string, bool);
+    bool verify(wheelsource &);
+    bool verify(wheelsource &,
+                const std::map<std::string, std::array<std::string, 3>> &);
     bool add(std::string, std::string, std::string, std::string);
-    void write(bool, boost::filesystem::path);
+    void write(boost::filesystem::path);
+    void write(std::ostream &);
+    bool contains(std::string);
+    std::string hashtype(std::string);
+    std::string hash(std::string);
+    std::string filesize(std::string);
+    std::vector<std::string> files();
 
   private:
     std::map<std::string, std::array<std::string, 3>> records;
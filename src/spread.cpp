@@ -24,6 +24,15 @@ SOFTWARE.
 
 #include "config.hpp"
 #include "functions.hpp"
+#include "lockfile.hpp"
+#include "manifest.hpp"
+#include "outfile.hpp"
+#include "outputsink.hpp"
+#include "ownerindex.hpp"
+#include "store.hpp"
+#include "transaction.hpp"
+#include "uringwriter.hpp"
+#include "wheelsource.hpp"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -33,26 +42,138 @@ SOFTWARE.
 #include <pstream.h>
 #include <pystring.h>
 
+#include <sys/types.h>
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <cstring>
 #include <fstream>
 #include <ios>
 #include <iostream>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
 
 namespace crosswrench {
-spread::spread(libzippp::ZipArchive &ar, bool _rootispurelib)
+
+namespace {
+// entries at least this large are preallocated and inflated in chunks of
+// LARGECHUNKSIZE to get fewer and larger writes, the part of the wheel they
+// were read from is dropped from the page cache once they are installed
+const libzippp_uint64 LARGEFILESIZE = 8 * 1024 * 1024;
+const libzippp_uint64 LARGECHUNKSIZE = 8 * 1024 * 1024;
+
+// stored entries at least this large are copied in parallel ranges while
+// another thread hashes them, their throughput is reported
+const std::uint64_t PARALLELCOPYSIZE = 64 * 1024 * 1024;
+
+// files are created with their final permissions, the umask is applied
+// by open
+const mode_t FILEMODE = 0666;
+const mode_t EXECMODE = 0777;
+
+// how much of the entries that follow the one being installed is read ahead
+const std::uint64_t READAHEADSIZE = 16 * 1024 * 1024;
+
+// entries up to this size are written with io_uring when it is used
+const libzippp_uint64 URINGFILESIZE = 256 * 1024;
+
+// the space counted for each file crosswrench writes itself and for each
+// row of RECORD when free space is checked
+const std::uint64_t SMALLFILEALLOWANCE = 4096;
+const std::uint64_t RECORDROWSIZE = 256;
+
+// the wheel RECORD and these settings decide the installed files, a hash of
+// them is stored in FINGERPRINTFILE so an identical install can be skipped
+const std::string FINGERPRINTFILE = "crosswrench.fingerprint";
+const std::vector<std::string> FINGERPRINTKEYS{
+    "data",      "direct-url", "direct-url-archive", "include",
+    "installer", "lazy",       "platlib",            "purelib",
+    "python",    "scripts",    "script-prefix",      "script-suffix"
+};
+
+// the zip written by --lazy stores its files uncompressed with names in
+// utf-8, the date of all of them is 1980-01-01 so the zip only depends on
+// the wheel
+const std::uint32_t ZIPLOCALSIG = 0x04034b50;
+const std::uint32_t ZIPCENTRALSIG = 0x02014b50;
+const std::uint32_t ZIPENDSIG = 0x06054b50;
+const std::uint16_t ZIPVERSION = 10;
+const std::uint16_t ZIPMADEBYUNIX = 3 << 8 | 20;
+const std::uint16_t ZIPUTF8FLAG = 0x800;
+const std::uint16_t ZIPDOSDATE = 1 << 5 | 1;
+const mode_t ZIPDIRMODE = 040755;
+const mode_t ZIPFILEMODE = 0100644;
+
+void
+putle(std::string &buf, std::uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        buf += (char)((value >> (8 * i)) & 0xff);
+    }
+}
+} // namespace
+
+spread::spread(wheelsource &ar,
+               bool _rootispurelib,
+               record &_wheelrecord)
   : wheelfile{ ar }
+  , wheelrecord{ _wheelrecord }
   , record2write{ dotdistinfodir() + "/RECORD,," }
   , rootispurelib{ _rootispurelib }
   , destdir{ config::instance()->get_value("destdir") }
-  , outmode{ std::ios_base::binary | std::ios_base::out }
   , verbose{ config::instance()->get_value("verbose") == "true" }
-{}
+  , durable{ config::instance()->get_value("durable") == "true" }
+  , lazy{ config::instance()->get_value("lazy") == "true" }
+  , txn{ journalpath(), durable }
+{
+    if (!config::instance()->get_value("manifest").empty()) {
+        filelist.reset(
+          new manifest{ config::instance()->get_value("manifest") });
+    }
+    manifestsha256 =
+      filelist && filelist->needssha256(h2b.strongest_algorithm_hashlib());
+
+    // io_uring and the store write to the filesystem themselves
+    if (config::instance()->get_value("output") == "memory") {
+        sink.reset(new memorysink{});
+        return;
+    }
+    if (config::instance()->get_value("output") == "tar") {
+        sink.reset(
+          new tarsink{ config::instance()->get_value("output-file"), destdir });
+        return;
+    }
+    sink.reset(new fssink{});
+
+    if (config::instance()->get_value("io-uring") == "true") {
+        ring.reset(new uringwriter());
+        if (!ring->available()) {
+            std::cout << "io_uring is not available, using blocking writes"
+                      << std::endl;
+            ring.reset();
+        }
+    }
+    if (!config::instance()->get_value("store").empty()) {
+        filestore.reset(
+          new store{ config::instance()->get_value("store"),
+                     config::instance()->get_value("store-hardlink") ==
+                       "true" });
+    }
+}
 
 void
 spread::compile()
 {
+    // compileall would read the list of files from the stdin of crosswrench
+    if (py_files.empty()) {
+        return;
+    }
+
     std::cout << "Byte-compiling .py files" << std::endl;
     std::string files;
     for (auto &p : py_files) {
@@ -74,37 +195,306 @@ spread::compile()
 void
 spread::install()
 {
+    if (!sink->isfilesystem()) {
+        installsink();
+        return;
+    }
+
     std::cout << "Installing files" << std::endl;
     auto files = wheelfile.getEntries();
 
     // check file permissions
     for (auto &file : files) {
         // files that should not be installed
-        if (isrecordfilenames(file.getName()) || file.isDirectory()) {
+        if (isrecordfilenames(file.getName()) || file.isDirectory() ||
+            inlazyarchive(file))
+        {
             continue;
         }
 
         checkinstallaccess(installpath(file));
     }
+    if (lazy) {
+        checkinstallaccess(lazyarchivepath());
+        checkinstallaccess(lazypthpath());
+    }
     checkinstallaccess(installpath("INSTALLER"));
     checkinstallaccess(installpath("RECORD"));
+    checkinstallaccess(journalpath());
+
+    // installs of other distributions into the same directories run at the
+    // same time, the global lock is only held while the installed
+    // distributions are read and this install claims its paths
+    auto lockroot = destdir / rootinstalldir(true);
+    sink->createdirs(lockfile::globalpath(lockroot));
+    lockfile distlock{ lockfile::distpath(lockroot, distname()) };
+    lockfile globallock{ lockfile::globalpath(lockroot) };
+    distlock.lock();
+    globallock.lock();
+
+    // finish or undo an install that was interrupted
+    transaction::recover(journalpath());
+
+    // files of an installed version of the distribution that are identical
+    // to the ones in the wheel are kept as they are
+    loadinstalledrecord();
+
+    // all files are staged and then renamed into place with RECORD last,
+    // the paths of the wheel entries are added to the journal at once
+    try {
+        std::vector<boost::filesystem::path> planned;
+        std::vector<std::pair<boost::filesystem::path, std::uint64_t>> sizes;
+        std::set<boost::filesystem::path> unchanged;
+        std::uint64_t lazysize = 0;
+        for (auto &file : files) {
+            if (isrecordfilenames(file.getName()) || file.isDirectory()) {
+                continue;
+            }
+            if (inlazyarchive(file)) {
+                lazysize += file.getSize() + SMALLFILEALLOWANCE;
+                continue;
+            }
+            auto filepath = installpath(file);
+            if (installunchanged(file, filepath)) {
+                unchanged.insert(filepath);
+                continue;
+            }
+            planned.push_back(filepath);
+            sizes.emplace_back(filepath, file.getSize());
+        }
+        if (lazy) {
+            planned.push_back(lazyarchivepath());
+            planned.push_back(lazypthpath());
+            sizes.emplace_back(lazyarchivepath(), lazysize);
+            sizes.emplace_back(lazypthpath(), SMALLFILEALLOWANCE);
+        }
+        checkconflicts(planned);
+        checkfreespace(sizes);
+        txn.stage(planned);
+        globallock.unlock();
+
+        // the entries are installed in the order their data is in the
+        // wheel, the following ones are read ahead while one is installed
+        std::vector<wheelentry> toinstall;
+        for (auto &file : wheelfile.inarchiveorder()) {
+            // files that should not be installed
+            if (isrecordfilenames(file.getName()) || file.isDirectory() ||
+                inlazyarchive(file) || unchanged.count(installpath(file)) != 0)
+            {
+                continue;
+            }
+            toinstall.push_back(file);
+        }
+        std::size_t ahead = 0;
+        std::uint64_t aheadsize = 0;
+        for (std::size_t i = 0; i < toinstall.size(); i++) {
+            while (ahead < toinstall.size() &&
+                   (ahead <= i || aheadsize < READAHEADSIZE))
+            {
+                wheelfile.willneed(toinstall[ahead]);
+                aheadsize += toinstall[ahead].getSize();
+                ahead++;
+            }
+            aheadsize -= toinstall[i].getSize();
+            installfile(toinstall[i], installpath(toinstall[i]));
+        }
+        if (lazy) {
+            installlazyarchive();
+        }
+        if (installedrecord && !unchanged.empty()) {
+            std::cout << "Kept " << unchanged.size() << " unchanged files"
+                      << std::endl;
+        }
+        if (ring) {
+            ring->flush();
+        }
+        installentrypointconsolescripts();
+        installinstallerfile();
+        installfingerprintfile();
+        if (!config::instance()->get_value("direct-url").empty()) {
+            installdirecturl();
+        }
+        if (durable) {
+            std::cout << "Syncing installed files to disk" << std::endl;
+            txn.syncstaged();
+        }
+        removestalefiles();
+        record2write.write(txn.stage(installpath("RECORD")));
+        txn.commit();
+    }
+    catch (...) {
+        if (ring) {
+            ring->drain();
+        }
+        txn.rollback();
+        throw;
+    }
+    if (durable) {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+          txn.synctime());
+        std::cout << "Syncing to disk added " << ms.count() << " ms"
+                  << std::endl;
+    }
+    // the index is updated with the RECORD that was just installed
+    globallock.lock();
+    ownerindex index{ destdir };
+    index.update(distname(), installpath("RECORD").parent_path());
+    if (!removeddirs.empty()) {
+        auto keep = transaction::claimeddirs(
+          installroots(destdir), lockroot, distname());
+        auto schemedirs = schemeinstalldirs(destdir);
+        keep.insert(schemedirs.begin(), schemedirs.end());
+        prunedirs(removeddirs, keep);
+    }
+    globallock.unlock();
+    compile();
 
-    // install files
-    for (auto &file : files) {
-        // files that should not be installed
+    if (filelist) {
+        addmanifestrecord(boost::filesystem::file_size(installpath("RECORD")));
+        addmanifestpycs();
+        filelist->write();
+    }
+}
+
+// nothing in destdir is read or written, the sink gets every file with the
+// path it would be installed at and RECORD after them, only archives get
+// byte-compiled files
+void
+spread::installsink()
+{
+    std::cout << "Installing files" << std::endl;
+    std::vector<std::pair<wheelentry, boost::filesystem::path>> pys;
+    for (auto &file : wheelfile.getEntries()) {
         if (isrecordfilenames(file.getName()) || file.isDirectory()) {
             continue;
         }
-
-        installfile(file, installpath(file));
+        auto filepath = installpath(file);
+        installfile(file, filepath);
+        if (pystring::endswith(file.getName(), ".py") && !isscript(file)) {
+            pys.emplace_back(file, filepath);
+        }
     }
     installentrypointconsolescripts();
     installinstallerfile();
     if (!config::instance()->get_value("direct-url").empty()) {
         installdirecturl();
     }
-    compile();
-    record2write.write(rootispurelib, destdir);
+
+    std::ostringstream recorddata;
+    record2write.write(recorddata);
+    auto recordfile = installpath("RECORD");
+    if (!sink->open(recordfile, FILEMODE, 0) ||
+        !sink->write(recorddata.str().data(), recorddata.str().size()) ||
+        !sink->close())
+    {
+        std::string msg{ "crosswrench install: could not write to file " };
+        msg += recordfile.string();
+        throw msg;
+    }
+    printverboseinstallloc("RECORD", recordfile.string());
+    if (filelist) {
+        addmanifestrecord(recorddata.str().size());
+    }
+    if (config::instance()->get_value("output") == "tar") {
+        compilesink(pys);
+    }
+    sink->finish();
+    if (filelist) {
+        filelist->write();
+    }
+}
+
+// the .py files are inflated again into a temporary directory, with the
+// mtime they have in the archive so the byte-compiled files match them,
+// and compiled there as if they were installed in /
+void
+spread::compilesink(
+  std::vector<std::pair<wheelentry, boost::filesystem::path>> &pys)
+{
+    if (pys.empty()) {
+        return;
+    }
+
+    std::cout << "Byte-compiling .py files" << std::endl;
+    auto stagedir = boost::filesystem::temp_directory_path() /
+                    boost::filesystem::unique_path("crosswrench-%%%%-%%%%");
+    auto normaldestdir = destdir.lexically_normal();
+    boost::filesystem::create_directories(stagedir);
+
+    try {
+        std::string files;
+        fssink staged;
+        for (auto &py : pys) {
+            auto stagepath =
+              stagedir /
+              py.second.lexically_normal().lexically_relative(normaldestdir);
+            staged.createdirs(stagepath);
+            bool ok = staged.open(stagepath, FILEMODE, 0);
+            if (ok && py.first.getSize() != 0) {
+                ok = wheelfile.readEntry(
+                       py.first,
+                       [&](const void *data, libzippp_uint64 data_size) {
+                           return staged.write(data, data_size);
+                       }) == LIBZIPPP_OK;
+            }
+            if (!staged.close() || !ok) {
+                std::string msg{ "crosswrench install: could not write to " };
+                msg += stagepath.string();
+                throw msg;
+            }
+            boost::filesystem::last_write_time(stagepath, sourcedateepoch());
+            files += stagepath.string() + "\n";
+        }
+
+        std::vector<std::string> output;
+        auto cmd = config::instance()->get_value("python") +
+                   " -m compileall -q -s " + stagedir.string() + " -p / -i -";
+        if (!get_cmd_output(cmd, output, files)) {
+            throw std::string{ "Failed to compile .py files" };
+        }
+
+        std::set<boost::filesystem::path> pycfiles;
+        for (auto &entry :
+             boost::filesystem::recursive_directory_iterator(stagedir))
+        {
+            if (entry.path().extension() == ".pyc") {
+                pycfiles.insert(entry.path());
+            }
+        }
+        for (auto &pycfile : pycfiles) {
+            auto filepath = destdir / pycfile.lexically_relative(stagedir);
+            filehasher hasher{ h2b.strongest_algorithm_botan(),
+                               manifestsha256 };
+            bool ok = sink->open(filepath, FILEMODE, 0);
+            ok = readfile(pycfile,
+                          [&](const std::uint8_t *data, std::size_t size) {
+                              hasher.update(data, size);
+                              ok = ok && sink->write(data, size);
+                          }) &&
+                 ok;
+            if (!sink->close() || !ok) {
+                std::string msg{ "crosswrench install: could not write " };
+                msg += filepath.string();
+                throw msg;
+            }
+            if (filelist) {
+                filelist->add(manifestpath(filepath),
+                              sink->filemode(FILEMODE),
+                              sink->size(),
+                              h2b.strongest_algorithm_hashlib(),
+                              hasher.digest(),
+                              hasher.sha256digest());
+            }
+            printverboseinstallloc(pycfile.filename().string(),
+                                   filepath.string());
+        }
+    }
+    catch (...) {
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(stagedir, ec);
+        throw;
+    }
+    boost::filesystem::remove_all(stagedir);
 }
 
 boost::filesystem::path
@@ -118,7 +508,7 @@ spread::createinstallpath(boost::filesystem::path prefix,
 }
 
 boost::filesystem::path
-spread::dotdatadirinstallpath(libzippp::ZipEntry &entry)
+spread::dotdatadirinstallpath(wheelentry &entry)
 {
     std::vector<std::string> dirnames;
     pystring::split(entry.getName(), dirnames, "/");
@@ -130,8 +520,19 @@ spread::dotdatadirinstallpath(libzippp::ZipEntry &entry)
 }
 
 boost::filesystem::path
-spread::installpath(libzippp::ZipEntry &entry)
+spread::installpath(wheelentry &entry)
 {
+    if (isscript(entry)) {
+        auto filepath = dotdatadirinstallpath(entry);
+        auto prefix = config::instance()->get_value("script-prefix");
+        auto suffix = config::instance()->get_value("script-suffix");
+        std::string newfilename = prefix + filepath.stem().string() + suffix +
+                                  filepath.extension().string();
+        filepath.remove_filename();
+        filepath /= newfilename;
+        return filepath;
+    }
+
     if (pystring::startswith(entry.getName(), dotdatadir())) {
         return dotdatadirinstallpath(entry);
     }
@@ -141,43 +542,78 @@ spread::installpath(libzippp::ZipEntry &entry)
 }
 
 void
-spread::installfile(libzippp::ZipEntry &entry, boost::filesystem::path filepath)
+spread::installfile(wheelentry &entry, boost::filesystem::path filepath)
 {
-    if (isscript(entry)) {
-        auto prefix = config::instance()->get_value("script-prefix");
-        auto suffix = config::instance()->get_value("script-suffix");
-        std::string newfilename = prefix + filepath.stem().string() + suffix +
-                                  filepath.extension().string();
-        filepath.remove_filename();
-        filepath /= newfilename;
+    // scripts are rewritten when installed so they can't come from the store
+    boost::filesystem::path storefile;
+    if (filestore && !isscript(entry) && entry.getSize() != 0) {
+        storefile = filestore->storepath(wheelrecord.hashtype(entry.getName()),
+                                         wheelrecord.hash(entry.getName()));
+        if (installfilestore(entry, filepath, storefile)) {
+            return;
+        }
     }
 
-    bool replace_python = isscript(entry);
-    bool setexec = isscript(entry) || iselfexec(entry, wheelfile);
-
-    boost::filesystem::ofstream output_p;
-    auto hasher = Botan::HashFunction::create(h2b.strongest_algorithm_botan());
+    // files of an unpacked wheel and entries stored without compression
+    // are copied instead of read through a buffer
+    boost::filesystem::path rangefile;
+    std::uint64_t offset;
+    if (!isscript(entry) && sink->isfilesystem() &&
+        wheelfile.entryrange(entry, rangefile, offset))
+    {
+        installfilecopy(entry, filepath, rangefile, offset, storefile);
+        return;
+    }
 
-    createdirs(filepath);
+    if (ring && storefile.empty() && !isscript(entry) &&
+        entry.getSize() <= URINGFILESIZE)
+    {
+        installfileuring(entry, filepath);
+        return;
+    }
 
-    output_p.open(filepath, outmode);
-    if (!output_p) {
-        std::string msg{ "crosswrench install: could not open " };
-        msg += filepath.string();
-        throw msg;
+    bool replace_python = isscript(entry);
+    bool setexec = isscript(entry) || entry.isexec();
+    bool large = entry.getSize() >= LARGEFILESIZE;
+
+    filehasher hasher{ h2b.strongest_algorithm_botan(), manifestsha256 };
+
+    // the file is opened when the first chunk is inflated so that an elf
+    // header in it can decide the mode the file is created with, other
+    // sinks than the filesystem get the size of entries written as they are
+    // so that they don't have to keep them
+    auto stagepath = outputpath(filepath);
+    std::uint64_t opensize = large ? entry.getSize() : 0;
+    if (!sink->isfilesystem()) {
+        opensize = isscript(entry) ? 0 : entry.getSize();
     }
+    auto openoutput = [&](const void *data, libzippp_uint64 data_size) {
+        if (!setexec) {
+            setexec = iselfexec((const std::uint8_t *)data, data_size);
+        }
+        return sink->open(
+          stagepath, setexec ? EXECMODE : FILEMODE, opensize);
+    };
 
+    bool openfailed = false;
     auto writer = [&](const void *data, libzippp_uint64 data_size) {
+        if (!sink->isopen() && !openoutput(data, data_size)) {
+            openfailed = true;
+            return false;
+        }
+
         if (replace_python) {
-            auto rb = writereplacedpython(data, data_size, hasher, output_p);
+            uintptr_t rb;
+            if (!writereplacedpython(data, data_size, hasher, rb)) {
+                return false;
+            }
             data = (const char *)data + rb;
             data_size -= rb;
             replace_python = false;
         }
 
-        hasher->update((const std::uint8_t *)data, data_size);
-        output_p.write((const char *)data, data_size);
-        return bool(output_p);
+        hasher.update(data, data_size);
+        return sink->write(data, data_size);
     };
 
     // debugging
@@ -186,8 +622,226 @@ spread::installfile(libzippp::ZipEntry &entry, boost::filesystem::path filepath)
     // libzippp can't handle file with 0 size, ignoring them works
     // since nothing needs to be written to get the correct hash
     // and create the correct file.
+    int ret = LIBZIPPP_OK;
+    if (entry.getSize() != 0) {
+        ret = wheelfile.readEntry(
+          entry, writer, large ? LARGECHUNKSIZE : LIBZIPPP_DEFAULT_CHUNK_SIZE);
+    }
+    if (ret == LIBZIPPP_OK && !sink->isopen()) {
+        openfailed = !openoutput(nullptr, 0);
+    }
+    if (openfailed) {
+        std::string msg{ "crosswrench install: could not open " };
+        msg += stagepath.string();
+        throw msg;
+    }
+    if (ret != LIBZIPPP_OK) {
+        std::string msg{ "crosswrench install: error of type " };
+        msg += libzipppretcodestr(ret);
+        msg += " when writing ";
+        msg += entry.getName();
+        msg += " to ";
+        msg += filepath.string();
+        throw msg;
+    }
+    if (!sink->close()) {
+        std::string msg{ "crosswrench install: could not write to file " };
+        msg += stagepath.string();
+        throw msg;
+    }
+    if (large) {
+        wheelfile.dontneed(entry);
+    }
+
+    if (pystring::endswith(entry.getName(), ".py") && !isscript(entry)) {
+        py_files.insert(filepath);
+    }
+
+    // first time the store sees this file
+    if (!storefile.empty()) {
+        filestore->add(stagepath, storefile);
+    }
+
+    add2record(filepath, hasher, sink->size(), setexec ? EXECMODE : FILEMODE);
+}
+
+// the file is created from the store if the store has a file with the
+// digest of the entry in the wheel RECORD
+bool
+spread::installfilestore(wheelentry &entry,
+                         boost::filesystem::path filepath,
+                         boost::filesystem::path storefile)
+{
+    boost::system::error_code ec;
+    auto size = boost::filesystem::file_size(storefile, ec);
+    if (ec || size != entry.getSize()) {
+        return false;
+    }
+
+    auto stagepath = outputpath(filepath);
+    bool setexec =
+      entry.isexec() || iselfexecfile(storefile);
+    if (!filestore->materialize(
+          storefile, stagepath, setexec ? EXECMODE : FILEMODE))
+    {
+        std::string msg{ "crosswrench install: could not install " };
+        msg += filepath.string();
+        msg += " from ";
+        msg += storefile.string();
+        throw msg;
+    }
+
+    // the store is shared, a file in it that was changed since it was
+    // added is not installed and the entry is inflated instead
+    auto name = entry.getName();
+    auto hashtype = h2b.strongest_algorithm_hashlib();
+    auto storehashtype = wheelrecord.hashtype(name);
+    filehasher hasher{ h2b.hashname(hashtype), manifestsha256 };
+    auto storehasher =
+      Botan::HashFunction::create(h2b.hashname(storehashtype));
+    auto hashdata = [&](const std::uint8_t *data, std::size_t data_size) {
+        hasher.update(data, data_size);
+        if (storehashtype != hashtype) {
+            storehasher->update(data, data_size);
+        }
+    };
+    if (!readfile(stagepath, hashdata)) {
+        std::string msg{ "crosswrench install: could not read " };
+        msg += stagepath.string();
+        throw msg;
+    }
+    auto hash = hasher.digest();
+    auto storehash =
+      storehashtype == hashtype
+        ? hash
+        : base64urlsafenopad(Botan::base64_encode(storehasher->final()));
+    if (storehash != wheelrecord.hash(name)) {
+        std::cerr << storefile.string()
+                  << " in the store does not match RECORD, " << name
+                  << " is installed from the wheel" << std::endl;
+        boost::filesystem::remove(stagepath, ec);
+        return false;
+    }
+
+    printverboseinstallloc(name, filepath.string());
+
+    if (pystring::endswith(name, ".py")) {
+        py_files.insert(filepath);
+    }
+
+    record2write.add(
+      recordpath(filepath), hashtype, hash, std::to_string(size));
+    recordmodes[recordpath(filepath)] = setexec ? EXECMODE : FILEMODE;
+    manifestdigests[recordpath(filepath)] = hasher.sha256digest();
+
+    return true;
+}
+
+// The data of the entry is a range of a file, all of an unpacked wheel
+// file or a stored entry in the wheel. The range is copied by the kernel
+// and hashed from a mapping of it, only when the kernel can't copy it is
+// it written from the mapping. A whole file is reflinked if possible.
+void
+spread::installfilecopy(wheelentry &entry,
+                        boost::filesystem::path filepath,
+                        boost::filesystem::path rangefile,
+                        std::uint64_t offset,
+                        boost::filesystem::path storefile)
+{
+    filehasher hasher{ h2b.strongest_algorithm_botan(), manifestsha256 };
+    bool setexec = entry.isexec();
+    auto stagepath = outputpath(filepath);
+
+    // debugging
+    printverboseinstallloc(entry.getName(), filepath.string());
+
+    outfile output_p;
+    bool opened = false;
+    bool written = false;
+    auto copyrange = [&](const std::uint8_t *data, std::size_t data_size) {
+        setexec = setexec || iselfexec(data, data_size);
+        opened = output_p.open(stagepath, setexec ? EXECMODE : FILEMODE, 0);
+        if (!opened) {
+            return;
+        }
+        if (offset == 0 && output_p.clone(rangefile)) {
+            hasher.update(data, data_size);
+            written = true;
+            return;
+        }
+        if (data_size >= PARALLELCOPYSIZE) {
+            // RECORD needs one digest of the whole file so it is computed
+            // on its own thread while the ranges are copied
+            auto start = std::chrono::steady_clock::now();
+            std::thread hashthread{ [&]() { hasher.update(data, data_size); } };
+            bool copied =
+              output_p.copyparallel(rangefile, offset, data_size, data);
+            hashthread.join();
+            written = copied || output_p.write(data, data_size);
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+            std::uint64_t mib = data_size / (1024 * 1024);
+            std::cout << "Copied " << entry.getName() << ", " << mib
+                      << " MiB in " << ms << " ms ("
+                      << mib * 1000 / std::max<std::int64_t>(ms, 1)
+                      << " MiB/s)" << std::endl;
+            return;
+        }
+        bool copied = output_p.copy(rangefile, offset, data_size);
+        hasher.update(data, data_size);
+        written = copied || output_p.write(data, data_size);
+    };
+    bool mapped =
+      readfilerange(rangefile, offset, entry.getSize(), copyrange);
+    if (mapped && !opened) {
+        std::string msg{ "crosswrench install: could not open " };
+        msg += stagepath.string();
+        throw msg;
+    }
+    if (!mapped || !written || !output_p.close()) {
+        std::string msg{ "crosswrench install: could not write to file " };
+        msg += stagepath.string();
+        throw msg;
+    }
+
+    if (pystring::endswith(entry.getName(), ".py")) {
+        py_files.insert(filepath);
+    }
+
+    // first time the store sees this file
+    if (!storefile.empty()) {
+        filestore->add(stagepath, storefile);
+    }
+
+    add2record(
+      filepath, hasher, output_p.size(), setexec ? EXECMODE : FILEMODE);
+}
+
+// the entry is inflated into memory and handed to io_uring, that writes it
+// while the following entries are inflated
+void
+spread::installfileuring(wheelentry &entry,
+                         boost::filesystem::path filepath)
+{
+    std::vector<char> data;
+    filehasher hasher{ h2b.strongest_algorithm_botan(), manifestsha256 };
+
+    auto stagepath = outputpath(filepath);
+
+    auto reader = [&](const void *chunk, libzippp_uint64 chunk_size) {
+        data.insert(data.end(),
+                    (const char *)chunk,
+                    (const char *)chunk + chunk_size);
+        return true;
+    };
+
+    // debugging
+    printverboseinstallloc(entry.getName(), filepath.string());
+
+    data.reserve(entry.getSize());
     if (entry.getSize() != 0) {
-        int ret = wheelfile.readEntry(entry, writer);
+        int ret = wheelfile.readEntry(entry, reader);
         if (ret != LIBZIPPP_OK) {
             std::string msg{ "crosswrench install: error of type " };
             msg += libzipppretcodestr(ret);
@@ -198,59 +852,56 @@ spread::installfile(libzippp::ZipEntry &entry, boost::filesystem::path filepath)
             throw msg;
         }
     }
-    output_p.close();
 
-    if (setexec) {
-        setexecperms(filepath);
-    }
+    bool setexec = entry.isexec() ||
+                   iselfexec((const std::uint8_t *)data.data(), data.size());
+    hasher.update(data.data(), data.size());
 
-    if (pystring::endswith(entry.getName(), ".py") && !isscript(entry)) {
+    if (pystring::endswith(entry.getName(), ".py")) {
         py_files.insert(filepath);
     }
 
-    add2record(filepath, hasher);
+    add2record(filepath, hasher, data.size(), setexec ? EXECMODE : FILEMODE);
+    ring->add(stagepath, setexec ? EXECMODE : FILEMODE, std::move(data));
 }
 
 void
 spread::installfile(const char *data,
                     size_t data_size,
-                    boost::filesystem::path filepath)
+                    boost::filesystem::path filepath,
+                    bool setexec)
 {
-    boost::filesystem::ofstream output_p;
-    auto hasher = Botan::HashFunction::create(h2b.strongest_algorithm_botan());
-
-    createdirs(filepath);
+    filehasher hasher{ h2b.strongest_algorithm_botan(), manifestsha256 };
 
-    output_p.open(filepath, outmode);
-    if (!output_p) {
+    auto stagepath = outputpath(filepath);
+    if (!sink->open(stagepath, setexec ? EXECMODE : FILEMODE, 0)) {
         std::string msg{ "crosswrench install: could not open " };
-        msg += filepath.string();
+        msg += stagepath.string();
         throw msg;
     }
 
-    hasher->update((const std::uint8_t *)data, data_size);
-    output_p.write(data, data_size);
-    if (!output_p) {
+    hasher.update(data, data_size);
+    if (!sink->write(data, data_size) || !sink->close()) {
         std::string msg{ "crosswrench install: could not write to file " };
-        msg += filepath.string();
+        msg += stagepath.string();
         throw msg;
     }
 
-    output_p.close();
-
-    add2record(filepath, hasher);
+    add2record(filepath, hasher, data_size, setexec ? EXECMODE : FILEMODE);
 }
 
-uintptr_t
+// replaced_bytes is set to the length of the #!python line that was
+// replaced, false is returned if the new line could not be written
+bool
 spread::writereplacedpython(const void *data,
                             libzippp_uint64 data_size,
-                            std::unique_ptr<Botan::HashFunction> &hasher,
-                            std::ofstream &output_p)
+                            filehasher &hasher,
+                            uintptr_t &replaced_bytes)
 {
     const char p_replace[] = "#!python";
     const char p_replacew[] = "#!pythonw";
     const uintptr_t w_pos = 8;
-    uintptr_t replaced_bytes = 0;
+    replaced_bytes = 0;
 
     if (data_size > strlen(p_replace)) {
         if (std::memcmp(p_replace, data, std::strlen(p_replace)) == 0) {
@@ -260,14 +911,168 @@ spread::writereplacedpython(const void *data,
                                ? std::strlen(p_replacew)
                                : std::strlen(p_replace);
 
-            hasher->update((const std::uint8_t *)hashbangpythoninterp.c_str(),
-                           hashbangpythoninterp.size());
-            output_p.write(hashbangpythoninterp.c_str(),
-                           hashbangpythoninterp.size());
+            if (!sink->write(hashbangpythoninterp.c_str(),
+                             hashbangpythoninterp.size()))
+            {
+                return false;
+            }
+            hasher.update(hashbangpythoninterp.c_str(),
+                          hashbangpythoninterp.size());
         }
     }
 
-    return replaced_bytes;
+    return true;
+}
+
+// with --lazy the files of the wheel that are not in .dist-info or .data
+// are put in one zip that zipimport loads them from
+bool
+spread::inlazyarchive(wheelentry &entry)
+{
+    return lazy &&
+           !pystring::startswith(entry.getName(), dotdistinfodir() + "/") &&
+           !pystring::startswith(entry.getName(), dotdatadir() + "/");
+}
+
+// the files are copied into the zip as they are inflated, without any
+// compression so that zipimport reads them directly, their crc is the one
+// in the wheel. Directory entries are added for all directories since
+// zipimport needs them to find namespace packages. A .pth file puts the
+// zip on sys.path.
+void
+spread::installlazyarchive()
+{
+    std::cout << "Installing " << lazyarchivepath().filename().string()
+              << std::endl;
+
+    std::vector<wheelentry> entries;
+    std::set<std::string> dirs;
+    for (auto &entry : wheelfile.getEntries()) {
+        if (isrecordfilenames(entry.getName()) || !inlazyarchive(entry)) {
+            continue;
+        }
+        std::vector<std::string> parts;
+        pystring::split(entry.getName(), parts, "/");
+        std::string dir;
+        for (std::size_t i = 0; i + 1 < parts.size(); i++) {
+            dir += parts[i] + "/";
+            dirs.insert(dir);
+        }
+        if (!entry.isDirectory()) {
+            entries.push_back(entry);
+        }
+    }
+
+    auto archivepath = lazyarchivepath();
+    auto stagepath = outputpath(archivepath);
+    filehasher hasher{ h2b.strongest_algorithm_botan(), manifestsha256 };
+    std::uint64_t offset = 0;
+    auto output = [&](const void *data, std::size_t data_size) {
+        hasher.update(data, data_size);
+        offset += data_size;
+        return sink->write(data, data_size);
+    };
+
+    std::string central;
+    std::uint64_t count = 0;
+    auto addheader = [&](const std::string &name,
+                         std::uint32_t crc,
+                         std::uint64_t size,
+                         mode_t mode) {
+        std::string local;
+        putle(local, ZIPLOCALSIG, 4);
+        putle(local, ZIPVERSION, 2);
+        putle(local, ZIPUTF8FLAG, 2);
+        putle(local, 0, 2);
+        putle(local, 0, 2);
+        putle(local, ZIPDOSDATE, 2);
+        putle(local, crc, 4);
+        putle(local, size, 4);
+        putle(local, size, 4);
+        putle(local, name.size(), 2);
+        putle(local, 0, 2);
+        local += name;
+
+        putle(central, ZIPCENTRALSIG, 4);
+        putle(central, ZIPMADEBYUNIX, 2);
+        central.append(local, 4, 26);
+        putle(central, 0, 2);
+        putle(central, 0, 2);
+        putle(central, 0, 2);
+        putle(central, (std::uint32_t)mode << 16, 4);
+        putle(central, offset, 4);
+        central += name;
+        count++;
+
+        return output(local.data(), local.size());
+    };
+
+    bool ok = sink->open(stagepath, FILEMODE, 0);
+    for (auto &dir : dirs) {
+        ok = ok && addheader(dir, 0, 0, ZIPDIRMODE);
+    }
+    for (auto &entry : entries) {
+        ok = ok && addheader(entry.getName(),
+                             (std::uint32_t)entry.getCRC(),
+                             entry.getSize(),
+                             ZIPFILEMODE);
+        if (ok && entry.getSize() != 0) {
+            int ret = wheelfile.readEntry(entry, output);
+            if (ret != LIBZIPPP_OK) {
+                std::string msg{ "crosswrench install: error of type " };
+                msg += libzipppretcodestr(ret);
+                msg += " when writing ";
+                msg += entry.getName();
+                msg += " to ";
+                msg += archivepath.string();
+                throw msg;
+            }
+        }
+    }
+
+    std::string end;
+    putle(end, ZIPENDSIG, 4);
+    putle(end, 0, 2);
+    putle(end, 0, 2);
+    putle(end, count, 2);
+    putle(end, count, 2);
+    putle(end, central.size(), 4);
+    putle(end, offset, 4);
+    putle(end, 0, 2);
+    ok = ok && output(central.data(), central.size()) &&
+         output(end.data(), end.size());
+    if (!sink->close() || !ok || offset > 0xffffffff) {
+        std::string msg{ "crosswrench install: could not write to file " };
+        msg += stagepath.string();
+        throw msg;
+    }
+    printverboseinstallloc(archivepath.filename().string(),
+                           archivepath.string());
+    add2record(archivepath, hasher, offset, FILEMODE);
+
+    std::string pth = archivepath.filename().string() + "\n";
+    installfile(pth.data(), pth.size(), lazypthpath(), false);
+    printverboseinstallloc(lazypthpath().filename().string(),
+                           lazypthpath().string());
+}
+
+// <name>-<version>.zip and .pth next to the .dist-info directory
+boost::filesystem::path
+spread::lazyarchivepath()
+{
+    auto path = installpath("RECORD").parent_path();
+    path.replace_extension(".zip");
+
+    return path;
+}
+
+boost::filesystem::path
+spread::lazypthpath()
+{
+    auto path = installpath("RECORD").parent_path();
+    path.replace_extension(".pth");
+
+    return path;
 }
 
 void
@@ -278,32 +1083,400 @@ spread::installinstallerfile()
 
     std::cout << "Installing INSTALLER file" << std::endl;
     std::string installerstr = config::instance()->get_value("installer");
-    installfile(installerstr.c_str(), installerstr.size(), installerpath);
+    installfile(installerstr.c_str(),
+                installerstr.size(),
+                installerpath,
+                false);
     printverboseinstallloc("INSTALLER", installerpath.string());
 }
 
+// a path that is in the RECORD of another installed distribution or that
+// is claimed by an install of another distribution in progress is a
+// conflict, the install fails instead of overwriting the file, the owners
+// are looked up in the index so only the paths of this wheel are read
 void
-spread::add2record(boost::filesystem::path filepath,
-                   std::unique_ptr<Botan::HashFunction> &hasher)
+spread::checkconflicts(const std::vector<boost::filesystem::path> &planned)
+{
+    std::set<boost::filesystem::path> paths;
+    for (auto &p : planned) {
+        paths.insert(p.lexically_normal());
+    }
+
+    auto ours = normalizedistname(distname());
+    std::vector<std::string> conflicts;
+
+    ownerindex index{ destdir };
+    index.load(ours);
+    for (auto &p : paths) {
+        auto owner = index.owner(p);
+        std::vector<std::string> parts;
+        pystring::split(owner, parts, "-");
+        if (!owner.empty() && normalizedistname(parts.at(0)) != ours) {
+            conflicts.push_back(p.string() + " is installed by " + owner);
+        }
+    }
+
+    auto lockroot = destdir / rootinstalldir(true);
+    auto roots = installroots(destdir);
+    for (auto &claim : transaction::liveclaims(roots, lockroot, ours)) {
+        if (paths.count(claim.first) == 1) {
+            conflicts.push_back(claim.first.string() +
+                                " is being installed by " + claim.second);
+        }
+    }
+
+    if (!conflicts.empty()) {
+        std::string msg{ "crosswrench install: " };
+        msg += dotdistinfodir();
+        msg += " conflicts with other distributions:";
+        for (auto &c : conflicts) {
+            msg += "\n  ";
+            msg += c;
+        }
+        throw msg;
+    }
+}
+
+// the sizes come from the central directory of the wheel, files from the
+// store are counted as copies and the small files crosswrench writes
+// itself get an allowance each
+void
+spread::checkfreespace(
+  std::vector<std::pair<boost::filesystem::path, std::uint64_t>> &sizes)
+{
+    auto recordsize = SMALLFILEALLOWANCE + sizes.size() * RECORDROWSIZE;
+    sizes.emplace_back(journalpath(), SMALLFILEALLOWANCE);
+    sizes.emplace_back(installpath("RECORD"), recordsize);
+    sizes.emplace_back(installpath("INSTALLER"), SMALLFILEALLOWANCE);
+    sizes.emplace_back(installpath(FINGERPRINTFILE), SMALLFILEALLOWANCE);
+
+    auto report = freespaceshortfall(sizes);
+    if (!report.empty()) {
+        std::string msg{ "crosswrench install: not enough free space to "
+                         "install " };
+        msg += dotdistinfodir();
+        msg += ":";
+        msg += report;
+        throw msg;
+    }
+}
+
+// an entry is unchanged when the installed RECORD lists its install path
+// with the size and digest the wheel RECORD has for it and the installed
+// file still hashes to that digest, the file is then added to the new
+// RECORD without being staged so it keeps its mtime
+bool
+spread::installunchanged(wheelentry &entry,
+                         boost::filesystem::path filepath)
+{
+    // scripts get their #!python line rewritten when installed
+    if (!installedrecord || isscript(entry)) {
+        return false;
+    }
+
+    auto name = entry.getName();
+    auto relpath = recordpath(filepath);
+    auto size = std::to_string(entry.getSize());
+    if (!installedrecord->contains(relpath) || !wheelrecord.contains(name) ||
+        installedrecord->filesize(relpath) != size ||
+        wheelrecord.filesize(name) != size)
+    {
+        return false;
+    }
+    if (installedrecord->hashtype(relpath) == wheelrecord.hashtype(name) &&
+        installedrecord->hash(relpath) != wheelrecord.hash(name))
+    {
+        return false;
+    }
+
+    boost::system::error_code ec;
+    auto status = boost::filesystem::status(filepath, ec);
+    if (ec || !boost::filesystem::is_regular_file(status) ||
+        boost::filesystem::file_size(filepath, ec) != entry.getSize() || ec)
+    {
+        return false;
+    }
+
+    auto wheelhasher =
+      Botan::HashFunction::create(h2b.hashname(wheelrecord.hashtype(name)));
+    filehasher hasher{ h2b.strongest_algorithm_botan(), manifestsha256 };
+    bool elfexec = false;
+    auto hashfile = [&](const std::uint8_t *data, std::size_t data_size) {
+        elfexec = iselfexec(data, data_size);
+        wheelhasher->update(data, data_size);
+        hasher.update(data, data_size);
+    };
+    if (!readfile(filepath, hashfile) ||
+        base64urlsafenopad(Botan::base64_encode(wheelhasher->final())) !=
+          wheelrecord.hash(name))
+    {
+        return false;
+    }
+
+    // the mode the file would be created with has to match as well
+    bool setexec = entry.isexec() || elfexec;
+    bool isexec =
+      (status.permissions() & boost::filesystem::owner_exe) != 0;
+    if (setexec != isexec) {
+        return false;
+    }
+
+    printverboseinstallloc(name, filepath.string() + " (unchanged)");
+
+    if (pystring::endswith(name, ".py")) {
+        py_files.insert(filepath);
+    }
+
+    add2record(
+      filepath, hasher, entry.getSize(), setexec ? EXECMODE : FILEMODE);
+
+    return true;
+}
+
+void
+spread::loadinstalledrecord()
 {
-    auto filepathrelroot = pystring::strip(
+    auto distinfo = installeddistinfo(destdir / rootinstalldir(rootispurelib),
+                                      distname());
+    if (distinfo.empty() ||
+        !boost::filesystem::is_regular_file(distinfo / "RECORD"))
+    {
+        return;
+    }
+
+    boost::filesystem::ifstream input_p{ distinfo / "RECORD",
+                                         std::ios_base::binary };
+    std::stringstream content;
+    content << input_p.rdbuf();
+
+    try {
+        installedrecord.reset(new record{ content.str(), true });
+    }
+    catch (std::string s) {
+        std::cout << "Ignoring installed " << (distinfo / "RECORD").string()
+                  << ": " << s << std::endl;
+        return;
+    }
+
+    std::cout << "Updating installed " << distinfo.filename().string()
+              << std::endl;
+}
+
+// files in the installed RECORD that are not in the new one are removed
+// when the install is committed, paths that resolve outside of destdir
+// are left alone
+void
+spread::removestalefiles()
+{
+    if (!installedrecord) {
+        return;
+    }
+
+    auto root = destdir / rootinstalldir(rootispurelib);
+    auto normaldestdir = destdir.lexically_normal();
+
+    std::set<boost::filesystem::path> installed;
+    for (auto &f : record2write.files()) {
+        installed.insert((root / f).lexically_normal());
+    }
+
+    for (auto &f : installedrecord->files()) {
+        auto filepath = (root / f).lexically_normal();
+        auto relpath = filepath.lexically_relative(normaldestdir);
+        if (installed.count(filepath) == 1 || relpath.empty() ||
+            *relpath.begin() == "..")
+        {
+            continue;
+        }
+        if (!boost::filesystem::is_regular_file(filepath) &&
+            !boost::filesystem::is_symlink(filepath))
+        {
+            continue;
+        }
+        // byte-compiled files of kept .py files are left to compileall
+        if (filepath.extension() == ".pyc" &&
+            filepath.parent_path().filename() == "__pycache__")
+        {
+            std::vector<std::string> parts;
+            pystring::split(filepath.filename().string(), parts, ".", 1);
+            auto source = filepath.parent_path().parent_path() /
+                          (parts.at(0) + ".py");
+            if (installed.count(source) == 1) {
+                continue;
+            }
+        }
+
+        printverboseinstallloc(f, "removed");
+        txn.remove(filepath);
+        removeddirs.insert(filepath.parent_path());
+        if (filepath.extension() == ".py") {
+            for (auto &pycfile : pycachefiles(filepath)) {
+                txn.remove(pycfile);
+                removeddirs.insert(pycfile.parent_path());
+            }
+        }
+    }
+}
+
+std::string
+spread::recordpath(boost::filesystem::path filepath)
+{
+    return pystring::strip(
       boost::filesystem::relative(filepath,
                                   destdir / rootinstalldir(rootispurelib))
         .string(),
       "\"");
+}
+
+// the distribution is installed from the same wheel with the same settings
+// when the stored fingerprint matches and no install of it was interrupted
+bool
+spread::isinstalled()
+{
+    if (!sink->isfilesystem()) {
+        return false;
+    }
+
+    auto fingerprintpath = installpath(FINGERPRINTFILE);
+    if (!boost::filesystem::is_regular_file(fingerprintpath) ||
+        !boost::filesystem::is_regular_file(installpath("RECORD")) ||
+        !boost::filesystem::is_regular_file(installpath("INSTALLER")) ||
+        boost::filesystem::exists(journalpath()))
+    {
+        return false;
+    }
+
+    boost::filesystem::ifstream input_p{ fingerprintpath,
+                                         std::ios_base::binary };
+    std::stringstream content;
+    content << input_p.rdbuf();
+
+    return content.str() == fingerprint();
+}
+
+void
+spread::installfingerprintfile()
+{
+    auto fingerprintpath = installpath(FINGERPRINTFILE);
+    auto fingerprintstr = fingerprint();
+
+    installfile(fingerprintstr.c_str(),
+                fingerprintstr.size(),
+                fingerprintpath,
+                false);
+    printverboseinstallloc(FINGERPRINTFILE, fingerprintpath.string());
+}
+
+// the archive of direct_url.json is only stat:ed, hashing it would read
+// all of it
+std::string
+spread::fingerprint()
+{
+    auto hasher = Botan::HashFunction::create(h2b.strongest_algorithm_botan());
+    std::string input =
+      wheelfile.getEntry(dotdistinfodir() + "/RECORD").readAsText();
+
+    for (auto &key : FINGERPRINTKEYS) {
+        input += key + "=" + config::instance()->get_value(key) + "\n";
+    }
+
+    auto archive = config::instance()->get_value("direct-url-archive");
+    if (!archive.empty()) {
+        boost::system::error_code ec;
+        auto size = boost::filesystem::file_size(archive, ec);
+        auto mtime = boost::filesystem::last_write_time(archive, ec);
+        input += "archive=" + std::to_string(size) + " " +
+                 std::to_string(mtime) + "\n";
+    }
+
+    hasher->update((const std::uint8_t *)input.data(), input.size());
+
+    return h2b.strongest_algorithm_hashlib() + "=" +
+           base64urlsafenopad(Botan::base64_encode(hasher->final())) + "\n";
+}
+
+// every file in RECORD with the mode it was created with, RECORD itself is
+// the only one without a hash
+void
+spread::addmanifestrecord(std::uint64_t recordsize)
+{
+    auto root = destdir / rootinstalldir(rootispurelib);
+    for (auto &f : record2write.files()) {
+        if (record2write.hashtype(f).empty()) {
+            filelist->add(manifestpath(root / f),
+                          sink->filemode(FILEMODE),
+                          recordsize,
+                          "",
+                          "",
+                          "");
+            continue;
+        }
+        filelist->add(manifestpath(root / f),
+                      sink->filemode(recordmodes.at(f)),
+                      std::stoull(record2write.filesize(f)),
+                      record2write.hashtype(f),
+                      record2write.hash(f),
+                      manifestdigests[f]);
+    }
+}
+
+// the byte-compiled files compileall wrote are the only files that are
+// read back, their names depend on the python version
+void
+spread::addmanifestpycs()
+{
+    for (auto &pyfile : py_files) {
+        for (auto &pycfile : pycachefiles(pyfile)) {
+            filehasher hasher{ h2b.strongest_algorithm_botan(),
+                               manifestsha256 };
+            std::uint64_t size = 0;
+            auto hashfile = [&](const std::uint8_t *data,
+                                std::size_t data_size) {
+                hasher.update(data, data_size);
+                size += data_size;
+            };
+            if (!readfile(pycfile, hashfile)) {
+                std::string msg{ "crosswrench install: could not read " };
+                msg += pycfile.string();
+                throw msg;
+            }
+            filelist->add(manifestpath(pycfile),
+                          sink->filemode(FILEMODE),
+                          size,
+                          h2b.strongest_algorithm_hashlib(),
+                          hasher.digest(),
+                          hasher.sha256digest());
+        }
+    }
+}
+
+void
+spread::add2record(boost::filesystem::path filepath,
+                   filehasher &hasher,
+                   std::uint64_t filesize,
+                   mode_t mode)
+{
+    auto filepathrelroot = recordpath(filepath);
+    recordmodes[filepathrelroot] = mode;
+    manifestdigests[filepathrelroot] = hasher.sha256digest();
 
     record2write.add(filepathrelroot,
                      h2b.strongest_algorithm_hashlib(),
-                     base64urlsafenopad(Botan::base64_encode(hasher->final())),
-                     std::to_string(boost::filesystem::file_size(filepath)));
+                     hasher.digest(),
+                     std::to_string(filesize));
 }
 
-void
-spread::createdirs(boost::filesystem::path filepath)
+// files are written to a staged path that is renamed into place when the
+// install is committed, other sinks get the install path
+boost::filesystem::path
+spread::outputpath(boost::filesystem::path filepath)
 {
-    boost::filesystem::path dirpath = filepath;
-    dirpath.remove_filename();
-    boost::filesystem::create_directories(dirpath);
+    if (!sink->isfilesystem()) {
+        return filepath;
+    }
+    sink->createdirs(filepath);
+
+    return txn.stage(filepath);
 }
 
 void
@@ -320,8 +1493,8 @@ spread::installentrypointconsolescripts()
                 auto scriptpath = scriptsdir / script.first;
                 installfile(script.second.c_str(),
                             script.second.size(),
-                            scriptpath);
-                setexecperms(scriptpath);
+                            scriptpath,
+                            true);
                 printverboseinstallloc(script.first, scriptpath.string());
             }
         }
@@ -364,7 +1537,10 @@ spread::installdirecturl()
     directurldata += "    }\n";
     directurldata += "}\n";
 
-    installfile(directurldata.data(), directurldata.size(), directurlpath);
+    installfile(directurldata.data(),
+                directurldata.size(),
+                directurlpath,
+                false);
     printverboseinstallloc("direct_url.json", directurlpath.string());
 }
 
@@ -386,8 +1562,15 @@ spread::checkinstallaccess(boost::filesystem::path filepath)
     errmsg += " failed: ";
 
     if (boost::filesystem::exists(filepath)) {
+        // a file hardlinked from the store is read-only, it is replaced
+        // by a rename so only its directory has to be writable
+        struct stat sb;
+        bool storelink = stat(filepath.c_str(), &sb) == 0 &&
+                         sb.st_nlink > 1 && (sb.st_mode & 0222) == 0;
         if (boost::filesystem::is_regular_file(filepath)) {
-            if (faccessat(AT_FDCWD, filepath.c_str(), W_OK, AT_EACCESS) != 0) {
+            if (!storelink &&
+                faccessat(AT_FDCWD, filepath.c_str(), W_OK, AT_EACCESS) != 0)
+            {
                 errmsg += filepath.string();
                 errmsg += " can't be written to";
                 throw errmsg;
@@ -436,6 +1619,25 @@ spread::checkinstallaccess(boost::filesystem::path filepath)
     while (filepathc.has_parent_path());
 }
 
+boost::filesystem::path
+spread::journalpath()
+{
+    auto path = destdir;
+    path /= rootinstalldir(rootispurelib);
+    path /= "." + dotdistinfodir() + ".journal";
+
+    return path;
+}
+
+// the path a file has when destdir is /
+std::string
+spread::manifestpath(boost::filesystem::path filepath)
+{
+    return "/" + filepath.lexically_normal()
+                   .lexically_relative(destdir.lexically_normal())
+                   .generic_string();
+}
+
 boost::filesystem::path
 spread::installpath(std::string filename)
 {
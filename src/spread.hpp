@@ -2,53 +2,109 @@
 #define _SRC_SPREAD_HPP_
 
 #include "hashlib2botan.hpp"
+#include "manifest.hpp"
+#include "outputsink.hpp"
 #include "record.hpp"
+#include "store.hpp"
+#include "transaction.hpp"
+#include "uringwriter.hpp"
+#include "wheelsource.hpp"
 
 #include <boost/filesystem.hpp>
-#include <botan/hash.h>
 #include <libzippp.h>
 
+#include <sys/types.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace crosswrench {
 
 class spread
 {
   public:
-    spread(libzippp::ZipArchive &, bool isrootpurelib);
+    spread(wheelsource &, bool isrootpurelib, record &);
     void install();
+    bool isinstalled();
 
   private:
     void add2record(boost::filesystem::path,
-                    std::unique_ptr<Botan::HashFunction> &);
+                    filehasher &,
+                    std::uint64_t,
+                    mode_t);
+    void addmanifestrecord(std::uint64_t);
+    void addmanifestpycs();
+    void checkconflicts(const std::vector<boost::filesystem::path> &);
+    void checkfreespace(
+      std::vector<std::pair<boost::filesystem::path, std::uint64_t>> &);
     void compile();
-    void createdirs(boost::filesystem::path);
+    void compilesink(
+      std::vector<std::pair<wheelentry, boost::filesystem::path>> &);
     boost::filesystem::path createinstallpath(boost::filesystem::path,
                                               boost::filesystem::path);
-    boost::filesystem::path dotdatadirinstallpath(libzippp::ZipEntry &);
-    boost::filesystem::path installpath(libzippp::ZipEntry &);
-    void installfile(libzippp::ZipEntry &, boost::filesystem::path);
-    void installfile(const char *, size_t, boost::filesystem::path);
+    boost::filesystem::path dotdatadirinstallpath(wheelentry &);
+    boost::filesystem::path installpath(wheelentry &);
+    void installfile(wheelentry &, boost::filesystem::path);
+    void installfileuring(wheelentry &, boost::filesystem::path);
+    bool installfilestore(wheelentry &,
+                          boost::filesystem::path,
+                          boost::filesystem::path);
+    void installfilecopy(wheelentry &,
+                         boost::filesystem::path,
+                         boost::filesystem::path,
+                         std::uint64_t,
+                         boost::filesystem::path);
+    void installfile(const char *, size_t, boost::filesystem::path, bool);
     void installinstallerfile();
-    uintptr_t writereplacedpython(const void *,
-                                  libzippp_uint64,
-                                  std::unique_ptr<Botan::HashFunction> &,
-                                  std::ofstream &);
+    bool inlazyarchive(wheelentry &);
+    void installlazyarchive();
+    boost::filesystem::path lazyarchivepath();
+    boost::filesystem::path lazypthpath();
+    void installsink();
+    void installfingerprintfile();
+    std::string fingerprint();
+    bool installunchanged(wheelentry &, boost::filesystem::path);
+    void loadinstalledrecord();
+    void removestalefiles();
+    std::string recordpath(boost::filesystem::path);
+    bool writereplacedpython(const void *,
+                             libzippp_uint64,
+                             filehasher &,
+                             uintptr_t &);
     void installentrypointconsolescripts();
     void installdirecturl();
     void printverboseinstallloc(std::string, std::string);
     void checkinstallaccess(boost::filesystem::path);
     boost::filesystem::path installpath(std::string);
+    boost::filesystem::path journalpath();
+    std::string manifestpath(boost::filesystem::path);
+    boost::filesystem::path outputpath(boost::filesystem::path);
 
-    libzippp::ZipArchive &wheelfile;
+    wheelsource &wheelfile;
+    record &wheelrecord;
     record record2write;
+    std::unique_ptr<record> installedrecord;
     bool rootispurelib;
     boost::filesystem::path destdir;
-    std::ios_base::openmode outmode;
     std::set<boost::filesystem::path> py_files;
+    std::set<boost::filesystem::path> removeddirs;
     hashlib2botan h2b;
     bool verbose;
+    bool durable;
+    bool lazy;
+    transaction txn;
+    std::unique_ptr<uringwriter> ring;
+    std::unique_ptr<store> filestore;
+    std::unique_ptr<outputsink> sink;
+    std::unique_ptr<manifest> filelist;
+    std::map<std::string, mode_t> recordmodes;
+    bool manifestsha256;
+    std::map<std::string, std::string> manifestdigests;
 };
 
 } // namespace crosswrench
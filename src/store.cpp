@@ -0,0 +1,157 @@
+/*
+Copyright (c) 2022 Niclas Rosenvik
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "store.hpp"
+
+#include "functions.hpp"
+#include "outfile.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <sys/types.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace crosswrench {
+
+namespace {
+// files in the store are read-only so that an install hardlinked to one
+// is not changed by accident
+const mode_t STOREFILEMODE = 0444;
+const mode_t STOREEXECMODE = 0555;
+} // namespace
+
+// The store holds one file per digest in a wheel RECORD, at
+// <dir>/<hash type>/<first two characters of the hash>/<hash>. Files are
+// only added after the wheel has been verified against RECORD, so the
+// content of a store file is the content the digest was calculated from.
+store::store(boost::filesystem::path _dir, bool _hardlink)
+  : dir{ _dir }
+  , hardlink{ _hardlink }
+{}
+
+boost::filesystem::path
+store::storepath(std::string hashtype, std::string hash)
+{
+    return dir / hashtype / hash.substr(0, 2) / hash;
+}
+
+// the file is created at filepath as a reflink of the store file, as a
+// hardlink to it if hardlinks are allowed and it has the same execute
+// permission or as a copy of it
+bool
+store::materialize(boost::filesystem::path storefile,
+                   boost::filesystem::path filepath,
+                   mode_t mode)
+{
+    outfile output_p;
+    if (!output_p.open(filepath, mode, 0)) {
+        return false;
+    }
+    if (output_p.clone(storefile)) {
+        return output_p.close();
+    }
+
+    struct stat sb;
+    if (hardlink && stat(storefile.c_str(), &sb) == 0 &&
+        ((sb.st_mode & 0111) != 0) == ((mode & 0111) != 0))
+    {
+        output_p.close();
+        if (unlink(filepath.c_str()) == 0 &&
+            link(storefile.c_str(), filepath.c_str()) == 0)
+        {
+            return true;
+        }
+        if (!output_p.open(filepath, mode, 0)) {
+            return false;
+        }
+    }
+
+    bool written = true;
+    auto copy = [&](const std::uint8_t *data, std::size_t data_size) {
+        written = output_p.write(data, data_size);
+    };
+
+    return readfile(storefile, copy) && written && output_p.close();
+}
+
+// the file is copied into the store under a temporary name and renamed
+// into place, a failure leaves the store as it was
+bool
+store::add(boost::filesystem::path filepath, boost::filesystem::path storefile)
+{
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(storefile.parent_path(), ec);
+    if (ec) {
+        return false;
+    }
+
+    struct stat sb;
+    if (stat(filepath.c_str(), &sb) != 0) {
+        return false;
+    }
+
+    auto tmppath = temppath(storefile);
+    outfile output_p;
+    if (!output_p.open(tmppath,
+                       (sb.st_mode & 0111) != 0 ? STOREEXECMODE
+                                                : STOREFILEMODE,
+                       0))
+    {
+        return false;
+    }
+
+    bool written = true;
+    auto copy = [&](const std::uint8_t *data, std::size_t data_size) {
+        written = output_p.write(data, data_size);
+    };
+
+    if ((output_p.clone(filepath) ||
+         (readfile(filepath, copy) && written)) &&
+        output_p.close())
+    {
+        boost::filesystem::rename(tmppath, storefile, ec);
+        if (!ec) {
+            return true;
+        }
+    }
+
+    boost::filesystem::remove(tmppath, ec);
+    return false;
+}
+
+boost::filesystem::path
+store::temppath(boost::filesystem::path filepath)
+{
+    auto tmppath = filepath.parent_path();
+    tmppath /= "." + filepath.filename().string() + ".crosswrench-" +
+               std::to_string(getpid());
+
+    return tmppath;
+}
+
+} // namespace crosswrench
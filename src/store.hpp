@@ -0,0 +1,29 @@
+#if !defined(_SRC_STORE_HPP_)
+#define _SRC_STORE_HPP_
+
+#include <boost/filesystem.hpp>
+
+#include <sys/types.h>
+
+#include <string>
+
+namespace crosswrench {
+
+class store
+{
+  public:
+    store(boost::filesystem::path, bool hardlink);
+    boost::filesystem::path storepath(std::string, std::string);
+    bool materialize(boost::filesystem::path, boost::filesystem::path, mode_t);
+    bool add(boost::filesystem::path, boost::filesystem::path);
+
+  private:
+    boost::filesystem::path temppath(boost::filesystem::path);
+
+    boost::filesystem::path dir;
+    bool hardlink;
+};
+
+} // namespace crosswrench
+
+#endif
@@ -23,12 +23,20 @@ SOFTWARE.
 #include "config.hpp"
 #include "functions.hpp"
 #include "hashlib2botan.hpp"
+#include "manifest.hpp"
+#include "outputsink.hpp"
 #include "record.hpp"
 #include "wheel.hpp"
+#include "wheelstream.hpp"
 
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
 #define CATCH_CONFIG_MAIN
 #include <catch2/catch.hpp>
 
+#include <sstream>
+#include <string>
+
 TEST_CASE("hashlib2botan", "[hashlib2botan]")
 {
     crosswrench::hashlib2botan h2b{};
@@ -68,6 +76,149 @@ TEST_CASE("iswheelfilenamevalid", "[iswheelfilenamvalid]")
     REQUIRE_FALSE(crosswrench::iswheelfilenamevalid("file.wheel"));
 }
 
+TEST_CASE("isunpackedwheelnamevalid", "[isunpackedwheelnamevalid]")
+{
+    REQUIRE(crosswrench::isunpackedwheelnamevalid("pkg-1.0"));
+    REQUIRE(crosswrench::isunpackedwheelnamevalid("pkg-1.0/"));
+    REQUIRE(crosswrench::isunpackedwheelnamevalid("dir/pkg-1.0-py3-none-any"));
+    REQUIRE_FALSE(crosswrench::isunpackedwheelnamevalid("pkg"));
+    REQUIRE_FALSE(crosswrench::isunpackedwheelnamevalid("pkg/"));
+    REQUIRE_FALSE(crosswrench::isunpackedwheelnamevalid("pkg-"));
+    REQUIRE_FALSE(crosswrench::isunpackedwheelnamevalid("/"));
+}
+
+TEST_CASE("iselfexec", "[iselfexec]")
+{
+    std::uint8_t elf[0x40] = { 0x7F, 0x45, 0x4c, 0x46, 2, 1, 1 };
+    elf[0x10] = 0x03; // e_type shared object
+    elf[0x14] = 1;    // e_version
+
+    REQUIRE(crosswrench::iselfexec(elf, sizeof(elf)));
+    REQUIRE_FALSE(crosswrench::iselfexec(elf, sizeof(elf) - 1));
+    REQUIRE_FALSE(crosswrench::iselfexec(nullptr, 0));
+    elf[0x10] = 0x01; // e_type relocatable
+    REQUIRE_FALSE(crosswrench::iselfexec(elf, sizeof(elf)));
+}
+
+TEST_CASE("normalizedistname", "[normalizedistname]")
+{
+    REQUIRE(crosswrench::normalizedistname("Foo.Bar-baz") == "foo_bar_baz");
+    REQUIRE(crosswrench::normalizedistname("foo_bar") == "foo_bar");
+}
+
+TEST_CASE("memorysink", "[memorysink]")
+{
+    crosswrench::memorysink sink;
+    REQUIRE_FALSE(sink.write("a", 1));
+    REQUIRE(sink.open("dir/file", 0644, 0));
+    REQUIRE(sink.write("ab", 2));
+    REQUIRE(sink.write("c", 1));
+    REQUIRE(sink.size() == 3);
+    REQUIRE(sink.close());
+    REQUIRE_FALSE(sink.isopen());
+    REQUIRE(sink.files().size() == 1);
+    REQUIRE(sink.files().at(0).path == "dir/file");
+    REQUIRE(sink.files().at(0).mode == 0644);
+    REQUIRE(sink.files().at(0).data == "abc");
+}
+
+TEST_CASE("mtree manifest", "[manifest]")
+{
+    auto mtreefile = boost::filesystem::temp_directory_path() /
+                     boost::filesystem::unique_path();
+    crosswrench::manifest mtree{ "mtree:" + mtreefile.string() };
+    REQUIRE(mtree.needssha256("sha3_512"));
+    REQUIRE_FALSE(mtree.needssha256("sha512"));
+
+    // the digests of an empty file
+    mtree.add("/a",
+              0644,
+              0,
+              "sha3_512",
+              "pp9zzKI6msXItWfcGFp1bpfJghZP4lhZ4NHcwUdcgKYVshI68fX5TBHj6UAsOsVY"
+              "9QAZnZW20-MBdYWGKB3NJg",
+              "47DEQpj8HBSa-_TImW-5JCeuQeRkm5NMpJWZG3hSuFU");
+    mtree.add("/b",
+              0644,
+              0,
+              "sha512",
+              "z4PhNX7vuL3xVChQ1m2AB9Yg5AULVxXcg_SpIdNs6c5H0NE8XYXysP-DGNKHfuwv"
+              "Y7kxvUdBeoGlODJ6-SfaPg",
+              "");
+    mtree.add("/c", 0644, 0, "", "", "");
+    mtree.write();
+
+    boost::filesystem::ifstream input{ mtreefile };
+    std::ostringstream output;
+    output << input.rdbuf();
+    input.close();
+    boost::filesystem::remove(mtreefile);
+
+    REQUIRE(output.str().find("sha3_512") == std::string::npos);
+    REQUIRE(output.str().find(
+              "./a type=file mode=0644 size=0 sha256digest="
+              "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+              "\n") != std::string::npos);
+    REQUIRE(output.str().find("./b type=file mode=0644 size=0 sha512digest="
+                              "cf83e135") != std::string::npos);
+    REQUIRE(output.str().find("./c type=file mode=0644 size=0\n") !=
+            std::string::npos);
+}
+
+TEST_CASE("wheelstream", "[wheelstream]")
+{
+    std::map<std::string, std::string> sm;
+    sm["algorithms"] = "{'sha256'}";
+    crosswrench::config::instance()->setup(sm);
+
+    // a zip with the stored file a containing hello
+    std::string local{ "PK\x03\x04\x14\0\0\0\0\0\0\0\0\0"
+                       "\x86\xa6\x10\x36\x05\0\0\0\x05\0\0\0\x01\0\0\0"
+                       "ahello",
+                       36 };
+    std::string central{ "PK\x01\x02\x14\0\x14\0\0\0\0\0\0\0\0\0"
+                         "\x86\xa6\x10\x36\x05\0\0\0\x05\0\0\0\x01\0\0\0"
+                         "\0\0\0\0\0\0\0\0\0\0\0\0\0\0a",
+                         47 };
+    std::string end{ "PK\x05\x06\0\0\0\0\x01\0\x01\0\x2f\0\0\0\x24\0\0\0\0\0",
+                     22 };
+
+    auto tmp = boost::filesystem::temp_directory_path();
+    std::istringstream wheeldata{ local + central + end };
+    crosswrench::wheelstream stream{ wheeldata, tmp };
+    REQUIRE_NOTHROW(stream.read());
+    REQUIRE(stream.hashes().size() == 1);
+    REQUIRE(stream.hashes().at("a").at(0) == "sha256");
+    REQUIRE(stream.hashes().at("a").at(2) == "5");
+    REQUIRE(boost::filesystem::file_size(stream.stagepath() / "a") == 5);
+
+    std::istringstream truncated{ local + central };
+    crosswrench::wheelstream truncatedstream{ truncated, tmp };
+    REQUIRE_THROWS_AS(truncatedstream.read(), std::string);
+
+    // the same file stored with its crc and size in a data descriptor
+    std::string desclocal{ "PK\x03\x04\x14\0\x08\0\0\0\0\0\0\0"
+                           "\0\0\0\0\0\0\0\0\0\0\0\0\x01\0\0\0"
+                           "ahello"
+                           "PK\x07\x08\x86\xa6\x10\x36\x05\0\0\0\x05\0\0\0",
+                           52 };
+    std::string desccentral{ central };
+    desccentral[8] = '\x08';
+    std::string descend{ end };
+    descend[16] = '\x34';
+    std::istringstream descdata{ desclocal + desccentral + descend };
+    crosswrench::wheelstream descstream{ descdata, tmp };
+    REQUIRE_NOTHROW(descstream.read());
+    REQUIRE(descstream.hashes().at("a") == stream.hashes().at("a"));
+
+    // a central directory that points somewhere else than the local header
+    std::string moved{ central };
+    moved[42] = 1;
+    std::istringstream movedoffset{ local + moved + end };
+    crosswrench::wheelstream movedstream{ movedoffset, tmp };
+    REQUIRE_THROWS_AS(movedstream.read(), std::string);
+}
+
 TEST_CASE("wheel class", "[wheel]")
 {
     REQUIRE_THROWS([&]() {
@@ -0,0 +1,465 @@
+/*
+Copyright (c) 2022 Niclas Rosenvik
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "transaction.hpp"
+
+#include "functions.hpp"
+#include "lockfile.hpp"
+
+#include <boost/filesystem.hpp>
+#include <pystring.h>
+
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace crosswrench {
+
+namespace {
+const std::string JSTAGE = "stage";
+const std::string JCOMMIT = "commit";
+const std::string JREMOVE = "remove";
+
+int
+openforsync(const boost::filesystem::path &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        std::string msg{ "crosswrench install: could not open " };
+        msg += path.string();
+        msg += " to sync it";
+        throw msg;
+    }
+
+    return fd;
+}
+
+void
+syncpath(const boost::filesystem::path &path)
+{
+    int fd = openforsync(path);
+    int ret = fsync(fd);
+    close(fd);
+    if (ret != 0) {
+        std::string msg{ "crosswrench install: could not sync " };
+        msg += path.string();
+        throw msg;
+    }
+}
+
+// syncs the data of all files, on linux with one syncfs per filesystem
+// and elsewhere with parallel fsyncs of the files
+void
+syncpaths(const std::vector<boost::filesystem::path> &paths)
+{
+#if defined(__linux__)
+    std::set<boost::filesystem::path> dirs;
+    std::set<dev_t> devices;
+    for (auto &path : paths) {
+        dirs.insert(path.parent_path());
+    }
+    for (auto &dir : dirs) {
+        int fd = openforsync(dir);
+        struct stat sb;
+        int ret = fstat(fd, &sb);
+        if (ret == 0 && devices.count(sb.st_dev) == 0) {
+            devices.insert(sb.st_dev);
+            ret = syncfs(fd);
+        }
+        close(fd);
+        if (ret != 0) {
+            std::string msg{ "crosswrench install: could not sync the "
+                             "filesystem of " };
+            msg += dir.string();
+            throw msg;
+        }
+    }
+#else
+    runparallel(paths.size(), [&](std::size_t i) { syncpath(paths[i]); });
+#endif
+}
+} // namespace
+
+// The journal is a text file with one step per line. Every file is written
+// to a staging path next to its final path, so that the commit is a rename
+// on the same filesystem, and a "stage" line is added before the staged file
+// is created. The "commit" line is added when everything is staged, after
+// it the staged files are renamed into place in the order they were staged,
+// the files on "remove" lines are removed and the journal is removed.
+//
+// In durable mode the staged files are synced before the commit line is
+// added and the directories holding the final paths are synced after the
+// renames.
+transaction::transaction(boost::filesystem::path _journalpath, bool _durable)
+  : journalpath{ _journalpath }
+  , durable{ _durable }
+  , committing{ false }
+  , synced{ 0 }
+  , syncduration{ 0 }
+{}
+
+boost::filesystem::path
+transaction::stage(boost::filesystem::path finalpath)
+{
+    auto path = stagepath(finalpath);
+
+    if (finalpaths.count(finalpath) == 0) {
+        journalline(JSTAGE + "\t" + path.string() + "\t" + finalpath.string(),
+                    true);
+        staged.emplace_back(path, finalpath);
+        finalpaths.insert(finalpath);
+    }
+
+    return path;
+}
+
+// stages many paths with one write to the journal, the files can then be
+// created in any order
+void
+transaction::stage(const std::vector<boost::filesystem::path> &paths)
+{
+    for (auto &finalpath : paths) {
+        if (finalpaths.count(finalpath) == 0) {
+            auto path = stagepath(finalpath);
+            journalline(JSTAGE + "\t" + path.string() + "\t" +
+                          finalpath.string(),
+                        false);
+            staged.emplace_back(path, finalpath);
+            finalpaths.insert(finalpath);
+        }
+    }
+    journalline("", true);
+}
+
+// the file is removed when the transaction is committed
+void
+transaction::remove(boost::filesystem::path filepath)
+{
+    journalline(JREMOVE + "\t" + filepath.string(), true);
+    removals.push_back(filepath);
+}
+
+void
+transaction::syncstaged()
+{
+    if (!durable || synced == staged.size()) {
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<boost::filesystem::path> paths;
+    for (auto i = synced; i < staged.size(); i++) {
+        paths.push_back(staged[i].first);
+    }
+
+    // a few files are cheaper to sync one by one than a whole filesystem
+    if (paths.size() <= 4) {
+        for (auto &path : paths) {
+            syncpath(path);
+        }
+    }
+    else {
+        syncpaths(paths);
+    }
+    synced = staged.size();
+
+    syncduration += std::chrono::steady_clock::now() - start;
+}
+
+void
+transaction::commit()
+{
+    syncstaged();
+    journalline(JCOMMIT, true);
+    committing = true;
+    if (durable) {
+        auto start = std::chrono::steady_clock::now();
+        syncpath(journalpath);
+        syncduration += std::chrono::steady_clock::now() - start;
+    }
+
+    for (auto &s : staged) {
+        boost::filesystem::rename(s.first, s.second);
+    }
+
+    for (auto &r : removals) {
+        boost::system::error_code ec;
+        boost::filesystem::remove(r, ec);
+    }
+
+    if (durable) {
+        auto start = std::chrono::steady_clock::now();
+        std::set<boost::filesystem::path> dirs;
+        for (auto &s : staged) {
+            dirs.insert(s.second.parent_path());
+        }
+        for (auto &r : removals) {
+            if (boost::filesystem::exists(r.parent_path())) {
+                dirs.insert(r.parent_path());
+            }
+        }
+        for (auto &dir : dirs) {
+            syncpath(dir);
+        }
+        syncduration += std::chrono::steady_clock::now() - start;
+    }
+
+    journal.close();
+    boost::filesystem::remove(journalpath);
+    staged.clear();
+    finalpaths.clear();
+    removals.clear();
+    synced = 0;
+    committing = false;
+}
+
+// Once the commit mark is in the journal the install can only be rolled
+// forward, a commit that failed after it keeps the staged files and the
+// journal so that recover finishes it on the next run.
+void
+transaction::rollback()
+{
+    boost::system::error_code ec;
+
+    if (committing) {
+        journal.close();
+        std::cerr << "The install was committed but not finished, it is "
+                     "rolled forward by the next run that recovers "
+                  << journalpath.string() << std::endl;
+        return;
+    }
+
+    for (auto &s : staged) {
+        boost::filesystem::remove(s.first, ec);
+    }
+
+    journal.close();
+    boost::filesystem::remove(journalpath, ec);
+    staged.clear();
+    finalpaths.clear();
+    removals.clear();
+    synced = 0;
+}
+
+std::chrono::steady_clock::duration
+transaction::synctime()
+{
+    return syncduration;
+}
+
+// the final paths of the files staged in the journal, these are claimed by
+// the install that writes the journal until it is committed
+std::vector<boost::filesystem::path>
+transaction::claimed(boost::filesystem::path journalpath)
+{
+    std::vector<boost::filesystem::path> paths;
+    std::ifstream input{ journalpath.string() };
+    std::string line;
+
+    while (std::getline(input, line)) {
+        std::vector<std::string> cells;
+        pystring::split(line, cells, "\t");
+        if (cells.size() == 3 && cells[0] == JSTAGE) {
+            paths.emplace_back(cells[2]);
+        }
+    }
+
+    return paths;
+}
+
+// The paths claimed by the journals in roots of installs that are in
+// progress, except the ones of the distribution skipname. A journal whose
+// distribution lock is free is left over from an interrupted install and
+// claims nothing. The journal of a .dist-info directory is named
+// .<.dist-info directory>.journal.
+std::map<boost::filesystem::path, std::string>
+transaction::liveclaims(const std::set<boost::filesystem::path> &roots,
+                        boost::filesystem::path lockroot,
+                        std::string skipname)
+{
+    const std::string suffix = ".dist-info.journal";
+    std::map<boost::filesystem::path, std::string> claims;
+    auto skip = normalizedistname(skipname);
+
+    for (auto &root : roots) {
+        boost::system::error_code ec;
+        for (boost::filesystem::directory_iterator i{ root, ec }, end;
+             !ec && i != end;
+             i.increment(ec))
+        {
+            auto filename = i->path().filename().string();
+            if (!pystring::startswith(filename, ".") ||
+                !pystring::endswith(filename, suffix))
+            {
+                continue;
+            }
+
+            auto distinfo =
+              filename.substr(1, filename.size() - 1 - std::strlen(".journal"));
+            std::vector<std::string> parts;
+            pystring::split(distinfo, parts, "-");
+            auto name = normalizedistname(parts.at(0));
+            if (name == skip) {
+                continue;
+            }
+
+            lockfile owner{ lockfile::distpath(lockroot, name) };
+            if (owner.trylock()) {
+                continue;
+            }
+
+            for (auto &p : claimed(i->path())) {
+                claims[p.lexically_normal()] = distinfo;
+            }
+        }
+    }
+
+    return claims;
+}
+
+// the directories of the live claims and all their parents, they must not
+// be pruned while another install is writing into them
+std::set<boost::filesystem::path>
+transaction::claimeddirs(const std::set<boost::filesystem::path> &roots,
+                         boost::filesystem::path lockroot,
+                         std::string skipname)
+{
+    std::set<boost::filesystem::path> dirs;
+
+    for (auto &claim : liveclaims(roots, lockroot, skipname)) {
+        auto dir = claim.first.parent_path();
+        while (!dir.empty() && dirs.insert(dir).second) {
+            dir = dir.parent_path();
+        }
+    }
+
+    return dirs;
+}
+
+bool
+transaction::recover(boost::filesystem::path journalpath)
+{
+    if (!boost::filesystem::exists(journalpath)) {
+        return false;
+    }
+
+    std::ifstream input{ journalpath.string() };
+    std::vector<std::pair<std::string, std::string>> steps;
+    std::vector<std::string> removes;
+    bool committed = false;
+    std::string line;
+
+    while (std::getline(input, line)) {
+        std::vector<std::string> cells;
+        pystring::split(line, cells, "\t");
+        if (cells.size() == 3 && cells[0] == JSTAGE) {
+            steps.emplace_back(cells[1], cells[2]);
+        }
+        else if (cells.size() == 2 && cells[0] == JREMOVE) {
+            removes.push_back(cells[1]);
+        }
+        else if (cells.size() == 1 && cells[0] == JCOMMIT) {
+            committed = true;
+        }
+    }
+    input.close();
+
+    if (committed) {
+        std::cout << "Rolling forward interrupted install recorded in "
+                  << journalpath.string() << std::endl;
+        for (auto &s : steps) {
+            if (boost::filesystem::exists(s.first)) {
+                boost::filesystem::rename(s.first, s.second);
+            }
+        }
+        for (auto &r : removes) {
+            boost::system::error_code ec;
+            boost::filesystem::remove(r, ec);
+        }
+    }
+    else {
+        std::cout << "Rolling back interrupted install recorded in "
+                  << journalpath.string() << std::endl;
+        for (auto &s : steps) {
+            boost::system::error_code ec;
+            boost::filesystem::remove(s.first, ec);
+        }
+    }
+
+    boost::filesystem::remove(journalpath);
+
+    return true;
+}
+
+boost::filesystem::path
+transaction::stagepath(const boost::filesystem::path &finalpath)
+{
+    boost::filesystem::path path = finalpath.parent_path();
+    path /= "." + finalpath.filename().string() + ".crosswrench-" +
+            std::to_string(getpid());
+
+    return path;
+}
+
+void
+transaction::journalline(std::string line, bool flush)
+{
+    if (!journal.is_open()) {
+        boost::filesystem::create_directories(journalpath.parent_path());
+        journal.open(journalpath.string(),
+                     std::ios_base::binary | std::ios_base::out |
+                       std::ios_base::trunc);
+        if (!journal) {
+            std::string msg{ "crosswrench install: could not open journal " };
+            msg += journalpath.string();
+            throw msg;
+        }
+    }
+
+    if (!line.empty()) {
+        journal << line << "\n";
+    }
+    if (flush) {
+        journal.flush();
+    }
+    if (!journal) {
+        std::string msg{ "crosswrench install: could not write to journal " };
+        msg += journalpath.string();
+        throw msg;
+    }
+}
+
+} // namespace crosswrench
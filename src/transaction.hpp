@@ -0,0 +1,58 @@
+#if !defined(_SRC_TRANSACTION_HPP_)
+#define _SRC_TRANSACTION_HPP_
+
+#include <boost/filesystem.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace crosswrench {
+
+class transaction
+{
+  public:
+    transaction() = delete;
+    transaction(boost::filesystem::path, bool);
+    boost::filesystem::path stage(boost::filesystem::path);
+    void stage(const std::vector<boost::filesystem::path> &);
+    void remove(boost::filesystem::path);
+    void syncstaged();
+    void commit();
+    void rollback();
+    std::chrono::steady_clock::duration synctime();
+    static bool recover(boost::filesystem::path);
+    static std::vector<boost::filesystem::path>
+      claimed(boost::filesystem::path);
+    static std::map<boost::filesystem::path, std::string>
+    liveclaims(const std::set<boost::filesystem::path> &,
+               boost::filesystem::path,
+               std::string);
+    static std::set<boost::filesystem::path>
+    claimeddirs(const std::set<boost::filesystem::path> &,
+                boost::filesystem::path,
+                std::string);
+
+  private:
+    boost::filesystem::path stagepath(const boost::filesystem::path &);
+    void journalline(std::string, bool);
+    boost::filesystem::path journalpath;
+    bool durable;
+    bool committing;
+    std::ofstream journal;
+    std::size_t synced;
+    std::chrono::steady_clock::duration syncduration;
+    std::vector<std::pair<boost::filesystem::path, boost::filesystem::path>>
+      staged;
+    std::set<boost::filesystem::path> finalpaths;
+    std::vector<boost::filesystem::path> removals;
+};
+
+} // namespace crosswrench
+
+#endif
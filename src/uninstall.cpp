@@ -0,0 +1,204 @@
+/*
+Copyright (c) 2022 Niclas Rosenvik
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "uninstall.hpp"
+
+#include "config.hpp"
+#include "functions.hpp"
+#include "lockfile.hpp"
+#include "ownerindex.hpp"
+#include "record.hpp"
+#include "transaction.hpp"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace crosswrench {
+
+namespace {
+// the files are removed in batches of this many, the batches are spread
+// over the threads of runparallel
+const std::size_t REMOVEBATCHSIZE = 64;
+} // namespace
+
+uninstall::uninstall(std::string _name)
+  : name{ _name }
+  , destdir{ config::instance()->get_value("destdir") }
+  , verbose{ config::instance()->get_value("verbose") == "true" }
+  , dryrun{ config::instance()->get_value("dry-run") == "true" }
+{}
+
+// RECORD is removed last so that an uninstall that fails can be run again
+void
+uninstall::remove()
+{
+    // an install of the distribution is waited for
+    auto lockroot = destdir / rootinstalldir(true);
+    lockfile distlock{ lockfile::distpath(lockroot, name) };
+    lockfile globallock{ lockfile::globalpath(lockroot) };
+    if (!dryrun && boost::filesystem::is_directory(lockroot)) {
+        distlock.lock();
+    }
+
+    auto distinfo = finddistinfo();
+    auto recordpath = distinfo / "RECORD";
+
+    boost::filesystem::ifstream input_p{ recordpath, std::ios_base::binary };
+    std::stringstream content;
+    content << input_p.rdbuf();
+    record installedrecord{ content.str(), true };
+
+    auto files = plannedfiles(distinfo, installedrecord);
+
+    if (dryrun) {
+        std::cout << "Would remove " << files.size() + 1 << " files of "
+                  << distinfo.filename().string() << std::endl;
+        for (auto &f : files) {
+            std::cout << f.string() << std::endl;
+        }
+        std::cout << recordpath.string() << std::endl;
+        return;
+    }
+
+    std::cout << "Removing " << files.size() + 1 << " files of "
+              << distinfo.filename().string() << std::endl;
+    std::set<boost::filesystem::path> dirs{ distinfo };
+    for (auto &f : files) {
+        dirs.insert(f.parent_path());
+    }
+
+    removefiles(files);
+    files.assign(1, recordpath);
+    removefiles(files);
+
+    // directories that installs in progress have claimed paths in are kept
+    globallock.lock();
+    ownerindex index{ destdir };
+    index.update(name, boost::filesystem::path{});
+    auto keep =
+      transaction::claimeddirs(installroots(destdir), lockroot, name);
+    auto schemedirs = schemeinstalldirs(destdir);
+    keep.insert(schemedirs.begin(), schemedirs.end());
+    prunedirs(dirs, keep);
+    globallock.unlock();
+}
+
+// the .dist-info directory is looked for in purelib and platlib
+boost::filesystem::path
+uninstall::finddistinfo()
+{
+    for (auto root : { rootinstalldir(true), rootinstalldir(false) }) {
+        auto distinfo = installeddistinfo(destdir / root, name);
+        if (!distinfo.empty() &&
+            boost::filesystem::is_regular_file(distinfo / "RECORD"))
+        {
+            return distinfo.lexically_normal();
+        }
+    }
+
+    std::string msg{ "crosswrench uninstall: " };
+    msg += name;
+    msg += " is not installed in ";
+    msg += (destdir / rootinstalldir(true)).string();
+    if (rootinstalldir(true) != rootinstalldir(false)) {
+        msg += " or ";
+        msg += (destdir / rootinstalldir(false)).string();
+    }
+    throw msg;
+}
+
+// the files in RECORD that exist and the byte-compiled files of the .py
+// files in it, paths in RECORD that resolve outside of destdir are skipped
+std::vector<boost::filesystem::path>
+uninstall::plannedfiles(boost::filesystem::path distinfo,
+                        record &installedrecord)
+{
+    auto root = distinfo.parent_path();
+    auto normaldestdir = destdir.lexically_normal();
+    auto recordpath = distinfo / "RECORD";
+    std::set<boost::filesystem::path> planned;
+
+    for (auto &f : installedrecord.files()) {
+        auto filepath = (root / f).lexically_normal();
+        auto relpath = filepath.lexically_relative(normaldestdir);
+        if (relpath.empty() || *relpath.begin() == ".." ||
+            filepath == recordpath)
+        {
+            continue;
+        }
+
+        boost::system::error_code ec;
+        auto status = boost::filesystem::symlink_status(filepath, ec);
+        if (!boost::filesystem::is_regular_file(status) &&
+            !boost::filesystem::is_symlink(status))
+        {
+            continue;
+        }
+
+        planned.insert(filepath);
+        if (filepath.extension() == ".py") {
+            auto pycfiles = pycachefiles(filepath);
+            planned.insert(pycfiles.begin(), pycfiles.end());
+        }
+    }
+
+    return std::vector<boost::filesystem::path>{ planned.begin(),
+                                                 planned.end() };
+}
+
+void
+uninstall::removefiles(std::vector<boost::filesystem::path> &files)
+{
+    auto batches = (files.size() + REMOVEBATCHSIZE - 1) / REMOVEBATCHSIZE;
+
+    runparallel(batches, [&](std::size_t batch) {
+        auto first = batch * REMOVEBATCHSIZE;
+        auto last = std::min(first + REMOVEBATCHSIZE, files.size());
+        for (auto i = first; i < last; i++) {
+            boost::system::error_code ec;
+            boost::filesystem::remove(files[i], ec);
+            if (ec) {
+                std::string msg{ "crosswrench uninstall: could not remove " };
+                msg += files[i].string();
+                msg += ": ";
+                msg += ec.message();
+                throw msg;
+            }
+        }
+    });
+
+    if (verbose) {
+        for (auto &f : files) {
+            std::cout << f.string() << " removed" << std::endl;
+        }
+    }
+}
+
+} // namespace crosswrench
@@ -0,0 +1,33 @@
+#if !defined(_SRC_UNINSTALL_HPP_)
+#define _SRC_UNINSTALL_HPP_
+
+#include "record.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <string>
+#include <vector>
+
+namespace crosswrench {
+
+class uninstall
+{
+  public:
+    uninstall(std::string);
+    void remove();
+
+  private:
+    boost::filesystem::path finddistinfo();
+    std::vector<boost::filesystem::path> plannedfiles(boost::filesystem::path,
+                                                      record &);
+    void removefiles(std::vector<boost::filesystem::path> &);
+
+    std::string name;
+    boost::filesystem::path destdir;
+    bool verbose;
+    bool dryrun;
+};
+
+} // namespace crosswrench
+
+#endif
@@ -0,0 +1,239 @@
+/*
+Copyright (c) 2022 Niclas Rosenvik
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "uringwriter.hpp"
+
+#include "outfile.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <sys/types.h>
+
+#include <fcntl.h>
+
+#include <cerrno>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace crosswrench {
+
+namespace {
+// files are written in batches of BATCHSIZE, one batch is filled while the
+// previous one is in flight, each batch uses its own half of the
+// registered file slots
+const unsigned BATCHSIZE = 64;
+const unsigned OPSPERFILE = 3;
+const unsigned OPOPEN = 0;
+const unsigned OPWRITE = 1;
+} // namespace
+
+// Every file is written with a linked openat, write and close on a direct
+// descriptor, so a file costs no syscalls of its own. Files whose chain
+// fails are written again with outfile when flushed, that also gives the
+// usual error messages.
+uringwriter::uringwriter()
+  : ringready{ false }
+  , slotbase{ 0 }
+  , pending{ 0 }
+{
+#if defined(USE_IO_URING)
+    if (io_uring_queue_init(BATCHSIZE * OPSPERFILE, &ring, 0) != 0) {
+        return;
+    }
+
+    std::vector<int> slots(2 * BATCHSIZE, -1);
+    if (io_uring_register_files(&ring, slots.data(), slots.size()) != 0) {
+        io_uring_queue_exit(&ring);
+        return;
+    }
+
+    ringready = true;
+#endif
+}
+
+uringwriter::~uringwriter()
+{
+#if defined(USE_IO_URING)
+    if (ringready) {
+        drain();
+        io_uring_queue_exit(&ring);
+    }
+#endif
+}
+
+bool
+uringwriter::available()
+{
+    return ringready;
+}
+
+void
+uringwriter::add(boost::filesystem::path path,
+                 mode_t mode,
+                 std::vector<char> data)
+{
+    filling.push_back(file{ path, mode, std::move(data), false });
+    if (filling.size() == BATCHSIZE) {
+        reap();
+        submit();
+    }
+}
+
+// waits for everything submitted, files that are not submitted yet are
+// dropped
+void
+uringwriter::drain()
+{
+    reap();
+    filling.clear();
+    failed.clear();
+}
+
+void
+uringwriter::flush()
+{
+    reap();
+    submit();
+    reap();
+
+    for (auto &f : failed) {
+        outfile output_p;
+        if (!output_p.open(f.path, f.mode, 0) ||
+            !output_p.write(f.data.data(), f.data.size()) || !output_p.close())
+        {
+            std::string msg{ "crosswrench install: could not write to file " };
+            msg += f.path.string();
+            failed.clear();
+            throw msg;
+        }
+    }
+    failed.clear();
+}
+
+void
+uringwriter::submit()
+{
+    if (filling.empty()) {
+        return;
+    }
+
+#if defined(USE_IO_URING)
+    if (ringready) {
+        for (unsigned i = 0; i < filling.size(); i++) {
+            unsigned slot = slotbase + i;
+            auto &f = filling[i];
+
+            auto sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_openat_direct(sqe,
+                                        AT_FDCWD,
+                                        f.path.c_str(),
+                                        O_WRONLY | O_CREAT | O_EXCL,
+                                        f.mode,
+                                        slot);
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe->user_data = i * OPSPERFILE + OPOPEN;
+
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_write(sqe, slot, f.data.data(), f.data.size(), 0);
+            sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+            sqe->user_data = i * OPSPERFILE + OPWRITE;
+
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_close_direct(sqe, slot);
+            sqe->user_data = i * OPSPERFILE + OPWRITE + 1;
+        }
+
+        unsigned total = filling.size() * OPSPERFILE;
+        int ret;
+        do {
+            ret = io_uring_submit(&ring);
+        }
+        while (ret == -EINTR);
+
+        if (ret >= 0 && unsigned(ret) == total) {
+            pending = total;
+            inflight.swap(filling);
+            filling.clear();
+            slotbase = slotbase == 0 ? BATCHSIZE : 0;
+            return;
+        }
+
+        // the ring is not trusted any more, the rest is written by flush
+        ringready = false;
+        pending = ret > 0 ? ret : 0;
+        inflight.swap(filling);
+        filling.clear();
+        for (auto &f : inflight) {
+            f.failed = true;
+        }
+        reap();
+        return;
+    }
+#endif
+
+    for (auto &f : filling) {
+        failed.push_back(std::move(f));
+    }
+    filling.clear();
+}
+
+void
+uringwriter::reap()
+{
+#if defined(USE_IO_URING)
+    while (pending > 0) {
+        struct io_uring_cqe *cqe;
+        int ret = io_uring_wait_cqe(&ring, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            for (auto &f : inflight) {
+                f.failed = true;
+            }
+            ringready = false;
+            break;
+        }
+
+        auto i = cqe->user_data / OPSPERFILE;
+        auto op = cqe->user_data % OPSPERFILE;
+        if (cqe->res < 0 || (op == OPWRITE && unsigned(cqe->res) !=
+                                                inflight.at(i).data.size()))
+        {
+            inflight.at(i).failed = true;
+        }
+        io_uring_cqe_seen(&ring, cqe);
+        pending--;
+    }
+    pending = 0;
+#endif
+
+    for (auto &f : inflight) {
+        if (f.failed) {
+            failed.push_back(std::move(f));
+        }
+    }
+    inflight.clear();
+}
+
+} // namespace crosswrench
@@ -0,0 +1,51 @@
+#if !defined(_SRC_URINGWRITER_HPP_)
+#define _SRC_URINGWRITER_HPP_
+
+#include <boost/filesystem.hpp>
+
+#include <sys/types.h>
+
+#if defined(USE_IO_URING)
+#include <liburing.h>
+#endif
+
+#include <vector>
+
+namespace crosswrench {
+
+class uringwriter
+{
+  public:
+    uringwriter();
+    ~uringwriter();
+    uringwriter(const uringwriter &) = delete;
+    uringwriter &operator=(const uringwriter &) = delete;
+    bool available();
+    void add(boost::filesystem::path, mode_t, std::vector<char>);
+    void drain();
+    void flush();
+
+  private:
+    struct file
+    {
+        boost::filesystem::path path;
+        mode_t mode;
+        std::vector<char> data;
+        bool failed;
+    };
+    void submit();
+    void reap();
+#if defined(USE_IO_URING)
+    struct io_uring ring;
+#endif
+    bool ringready;
+    unsigned slotbase;
+    unsigned pending;
+    std::vector<file> filling;
+    std::vector<file> inflight;
+    std::vector<file> failed;
+};
+
+} // namespace crosswrench
+
+#endif
@@ -0,0 +1,729 @@
+/*
+Copyright (c) 2022 Niclas Rosenvik
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "wheelsource.hpp"
+
+#include "functions.hpp"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <libzippp.h>
+
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zip.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <ios>
+#include <limits>
+#include <memory>
+#include <new>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace crosswrench {
+
+namespace {
+const std::uint32_t LOCALSIG = 0x04034b50;
+const std::uint32_t CENTRALSIG = 0x02014b50;
+const std::uint32_t ZIP64LOCATORSIG = 0x07064b50;
+const std::uint32_t ZIP64ENDSIG = 0x06064b50;
+const std::uint32_t ENDSIG = 0x06054b50;
+const std::uint16_t ZIP64EXTRAID = 0x0001;
+const std::uint16_t FLAGENCRYPTED = 0x0001;
+const std::uint16_t METHODSTORED = 0;
+const std::uint16_t METHODDEFLATED = 8;
+const std::uint64_t ZIP32MAX = 0xffffffff;
+const std::size_t LOCALHEADERSIZE = 30;
+const std::size_t CENTRALHEADERSIZE = 46;
+const std::size_t ENDSIZE = 22;
+const std::size_t ZIP64LOCATORSIZE = 20;
+const std::size_t ZIP64ENDSIZE = 56;
+const std::size_t MAXCOMMENTSIZE = 0xffff;
+
+// deflated entries that need a larger buffer than this with the inflater
+// crosswrench was built with are read through libzippp
+const std::uint64_t MAXINFLATEBUFFER = 64 * 1024 * 1024;
+
+// the buffer entries are inflated into starts at a page, so the large
+// chunks of large entries are written from whole pages
+std::unique_ptr<std::uint8_t, void (*)(void *)>
+pagebuffer(std::uint64_t size)
+{
+    void *data = nullptr;
+    if (posix_memalign(&data, sysconf(_SC_PAGESIZE), size) != 0) {
+        throw std::bad_alloc();
+    }
+
+    return { (std::uint8_t *)data, free };
+}
+
+// len bytes at offset in the mapping, empty if they are outside of it
+std::string
+readat(const std::uint8_t *mapping,
+       std::uint64_t mappingsize,
+       std::uint64_t offset,
+       std::uint64_t len)
+{
+    if (offset > mappingsize || len > mappingsize - offset) {
+        return std::string{};
+    }
+    return std::string((const char *)mapping + offset, len);
+}
+
+// the data is handed to output in chunks like libzippp does
+bool
+writechunks(const std::uint8_t *data,
+            std::uint64_t data_size,
+            std::function<bool(const void *, libzippp_uint64)> &output,
+            libzippp_uint64 chunksize)
+{
+    while (data_size != 0) {
+        auto len = std::min<std::uint64_t>(data_size, chunksize);
+        if (!output(data, len)) {
+            return false;
+        }
+        data += len;
+        data_size -= len;
+    }
+    return true;
+}
+
+// the range of a file is mapped and handed to output in chunks
+int
+readrange(const boost::filesystem::path &filepath,
+          std::uint64_t offset,
+          std::uint64_t length,
+          std::function<bool(const void *, libzippp_uint64)> &output,
+          libzippp_uint64 chunksize)
+{
+    if (chunksize == 0) {
+        chunksize = LIBZIPPP_DEFAULT_CHUNK_SIZE;
+    }
+
+    bool ok = true;
+    auto chunks = [&](const std::uint8_t *data, std::size_t data_size) {
+        ok = writechunks(data, data_size, output, chunksize);
+    };
+    if (!readfilerange(filepath, offset, length, chunks)) {
+        return LIBZIPPP_ERROR_FREAD_FAILURE;
+    }
+
+    return ok ? LIBZIPPP_OK : LIBZIPPP_ERROR_OWRITE_FAILURE;
+}
+} // namespace
+
+wheelentry::wheelentry(const wheelsource *_source,
+                       std::string _name,
+                       std::uint64_t _size,
+                       bool _directory,
+                       bool _exec,
+                       libzippp_uint64 _index)
+  : source{ _source }
+  , name{ _name }
+  , size{ _size }
+  , directory{ _directory }
+  , exec{ _exec }
+  , index{ _index }
+{}
+
+std::string
+wheelentry::getName() const
+{
+    return name;
+}
+
+bool
+wheelentry::isDirectory() const
+{
+    return directory;
+}
+
+std::uint64_t
+wheelentry::getSize() const
+{
+    return size;
+}
+
+std::uint32_t
+wheelentry::getCRC() const
+{
+    return source->crc(*this);
+}
+
+std::string
+wheelentry::readAsText() const
+{
+    std::string text;
+    if (size != 0) {
+        source->readEntry(*this,
+                          [&](const void *data, libzippp_uint64 data_size) {
+                              text.append((const char *)data, data_size);
+                              return true;
+                          });
+    }
+
+    return text;
+}
+
+libzippp_uint64
+wheelentry::getIndex() const
+{
+    return index;
+}
+
+// true if the entry has any of the execute bits set in its mode
+bool
+wheelentry::isexec() const
+{
+    return exec;
+}
+
+std::vector<wheelentry>
+wheelsource::getEntries() const
+{
+    return entries;
+}
+
+bool
+wheelsource::hasEntry(const std::string &name) const
+{
+    return names.count(name) != 0;
+}
+
+wheelentry
+wheelsource::getEntry(const std::string &name) const
+{
+    auto found = names.find(name);
+    if (found != names.end()) {
+        return entries[found->second];
+    }
+
+    throw std::string("crosswrench install: ") + name +
+      std::string(" is not in the wheel");
+}
+
+// the entries are looked up by name for every row of RECORD, an entry that
+// is in the wheel twice is found as the first one
+void
+wheelsource::setentries(std::vector<wheelentry> _entries)
+{
+    entries = std::move(_entries);
+    names.clear();
+    for (std::size_t i = 0; i < entries.size(); i++) {
+        names.emplace(entries[i].getName(), i);
+    }
+}
+
+// the file and the offset in it where the data of the entry is as it is
+// installed, false if it has to be read through readEntry
+bool
+wheelsource::entryrange(const wheelentry &,
+                        boost::filesystem::path &,
+                        std::uint64_t &) const
+{
+    return false;
+}
+
+// the entries sorted by where their data is, reading them in this order
+// reads the source from start to end
+std::vector<wheelentry>
+wheelsource::inarchiveorder() const
+{
+    auto entries = getEntries();
+    std::stable_sort(entries.begin(),
+                     entries.end(),
+                     [&](const wheelentry &a, const wheelentry &b) {
+                         return entryoffset(a) < entryoffset(b);
+                     });
+
+    return entries;
+}
+
+// the position of the data of the entry in the source, the index unless
+// the source knows better
+std::uint64_t
+wheelsource::entryoffset(const wheelentry &entry) const
+{
+    return entry.getIndex();
+}
+
+// a hint that the entry is read soon, the source can start reading it
+void
+wheelsource::willneed(const wheelentry &) const
+{}
+
+// a hint that the entry has been read and won't be again, the source can
+// let go of the memory it keeps for it
+void
+wheelsource::dontneed(const wheelentry &) const
+{}
+
+zipsource::zipsource(std::string _filepath)
+  : filepath{ _filepath }
+  , archive{ new libzippp::ZipArchive{ _filepath } }
+  , engine{ inflater::create() }
+  , mapping{ nullptr }
+  , mappingsize{ 0 }
+{}
+
+zipsource::~zipsource()
+{
+    if (mapping != nullptr) {
+        munmap((void *)mapping, mappingsize);
+    }
+}
+
+// the whole zip file is mapped, nothing is if it can't be
+void
+zipsource::mapfile()
+{
+    int fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0) {
+        close(fd);
+        return;
+    }
+    void *data = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return;
+    }
+    posix_madvise(data, sb.st_size, POSIX_MADV_SEQUENTIAL);
+    mapping = (const std::uint8_t *)data;
+    mappingsize = sb.st_size;
+}
+
+// The central directory is read again to find the entries stored without
+// compression or deflated and where their data starts after their local
+// header, libzip doesn't tell. Nothing is found if anything about the
+// directory looks wrong, the entries are then read through libzippp.
+void
+zipsource::findranges()
+{
+    std::uint64_t filesize = mappingsize;
+    if (filesize < ENDSIZE) {
+        return;
+    }
+
+    auto tailsize = std::min<std::uint64_t>(filesize, ENDSIZE + MAXCOMMENTSIZE);
+    auto tail = readat(mapping, filesize, filesize - tailsize, tailsize);
+    std::size_t endpos = tail.size() - ENDSIZE + 1;
+    do {
+        endpos--;
+    } while (endpos != 0 && getle(tail, endpos, 4) != ENDSIG);
+    if (getle(tail, endpos, 4) != ENDSIG) {
+        return;
+    }
+
+    std::uint64_t count = getle(tail, endpos + 10, 2);
+    std::uint64_t cdsize = getle(tail, endpos + 12, 4);
+    std::uint64_t cdoffset = getle(tail, endpos + 16, 4);
+    std::uint64_t endoffset = filesize - tailsize + endpos;
+    if (count == 0xffff || cdsize == ZIP32MAX || cdoffset == ZIP32MAX) {
+        if (endoffset < ZIP64LOCATORSIZE) {
+            return;
+        }
+        auto locator = readat(mapping,
+                              filesize,
+                              endoffset - ZIP64LOCATORSIZE,
+                              ZIP64LOCATORSIZE);
+        if (locator.empty() || getle(locator, 0, 4) != ZIP64LOCATORSIG) {
+            return;
+        }
+        auto end64 =
+          readat(mapping, filesize, getle(locator, 8, 8), ZIP64ENDSIZE);
+        if (end64.empty() || getle(end64, 0, 4) != ZIP64ENDSIG) {
+            return;
+        }
+        count = getle(end64, 32, 8);
+        cdsize = getle(end64, 40, 8);
+        cdoffset = getle(end64, 48, 8);
+    }
+    if (cdoffset > filesize || cdsize > filesize - cdoffset) {
+        return;
+    }
+
+    auto cd = readat(mapping, filesize, cdoffset, cdsize);
+    std::set<std::string> names;
+    std::set<std::string> duplicates;
+    std::size_t pos = 0;
+    for (std::uint64_t i = 0; i < count; i++) {
+        if (pos + CENTRALHEADERSIZE > cd.size() ||
+            getle(cd, pos, 4) != CENTRALSIG)
+        {
+            dataranges.clear();
+            return;
+        }
+        auto flags = getle(cd, pos + 8, 2);
+        auto method = getle(cd, pos + 10, 2);
+        std::uint32_t crc = getle(cd, pos + 16, 4);
+        std::uint64_t compressedsize = getle(cd, pos + 20, 4);
+        std::uint64_t size = getle(cd, pos + 24, 4);
+        auto namelen = getle(cd, pos + 28, 2);
+        auto extralen = getle(cd, pos + 30, 2);
+        auto commentlen = getle(cd, pos + 32, 2);
+        std::uint64_t localoffset = getle(cd, pos + 42, 4);
+        auto namepos = pos + CENTRALHEADERSIZE;
+        pos = namepos + namelen + extralen + commentlen;
+        if (pos > cd.size()) {
+            dataranges.clear();
+            return;
+        }
+        auto name = cd.substr(namepos, namelen);
+
+        // the zip64 extra field has the values that didn't fit, in order
+        auto extra = cd.substr(namepos + namelen, extralen);
+        std::size_t extrapos = 0;
+        while (extrapos + 4 <= extra.size()) {
+            auto id = getle(extra, extrapos, 2);
+            auto len = getle(extra, extrapos + 2, 2);
+            auto field = extrapos + 4;
+            extrapos = field + len;
+            if (id != ZIP64EXTRAID || extrapos > extra.size()) {
+                continue;
+            }
+            for (auto value : { &size, &compressedsize, &localoffset }) {
+                if (*value == ZIP32MAX && field + 8 <= extrapos) {
+                    *value = getle(extra, field, 8);
+                    field += 8;
+                }
+            }
+        }
+
+        if (!names.insert(name).second) {
+            duplicates.insert(name);
+        }
+        if ((flags & FLAGENCRYPTED) != 0 ||
+            (method == METHODSTORED && compressedsize != size) ||
+            (method != METHODSTORED && method != METHODDEFLATED))
+        {
+            continue;
+        }
+
+        auto local = readat(mapping, filesize, localoffset, LOCALHEADERSIZE);
+        if (local.empty() || getle(local, 0, 4) != LOCALSIG) {
+            continue;
+        }
+        std::uint64_t dataoffset =
+          localoffset + LOCALHEADERSIZE + getle(local, 26, 2) +
+          getle(local, 28, 2);
+        if (dataoffset <= filesize &&
+            compressedsize <= filesize - dataoffset)
+        {
+            dataranges[name] = { (std::uint16_t)method,
+                                 crc,
+                                 dataoffset,
+                                 compressedsize };
+        }
+    }
+
+    // an entry that is in the zip twice is left to libzip
+    for (auto &name : duplicates) {
+        dataranges.erase(name);
+    }
+}
+
+// the entries have the execute bits set if they were added on a unix
+// system with any of them set in the mode kept in the external attributes
+bool
+zipsource::open()
+{
+    if (!archive->open(libzippp::ZipArchive::ReadOnly, true)) {
+        return false;
+    }
+
+    std::vector<wheelentry> zipentries;
+    for (auto &e : archive->getEntries()) {
+        zip_uint8_t opsys;
+        zip_uint32_t attributes;
+        bool exec = zip_file_get_external_attributes(archive->getZipHandle(),
+                                                     e.getIndex(),
+                                                     0,
+                                                     &opsys,
+                                                     &attributes) == 0 &&
+                    opsys == ZIP_OPSYS_UNIX &&
+                    ((attributes >> 16) & 0111) != 0;
+        zipentries.emplace_back(
+          this, e.getName(), e.getSize(), e.isDirectory(), exec, e.getIndex());
+    }
+    setentries(std::move(zipentries));
+    mapfile();
+    findranges();
+
+    return true;
+}
+
+// Stored entries are read from the mapping and deflated ones are inflated
+// from it into a buffer, their crc is checked like libzip does. The crc of
+// a stored entry is checked before any of it is handed to output. Entries
+// copied from their range by entryrange are not checked here, they are
+// read through here when RECORD is verified before the install.
+int
+zipsource::readEntry(const wheelentry &entry,
+                     std::function<bool(const void *, libzippp_uint64)> output,
+                     libzippp_uint64 chunksize) const
+{
+    if (chunksize == 0) {
+        chunksize = LIBZIPPP_DEFAULT_CHUNK_SIZE;
+    }
+
+    auto range = dataranges.find(entry.getName());
+    if (range != dataranges.end() && range->second.method == METHODSTORED) {
+        auto data = mapping + range->second.offset;
+        if (crc32_z(crc32(0, Z_NULL, 0), data, entry.getSize()) !=
+            range->second.crc)
+        {
+            return LIBZIPPP_ERROR_FREAD_FAILURE;
+        }
+        return writechunks(data, entry.getSize(), output, chunksize)
+                 ? LIBZIPPP_OK
+                 : LIBZIPPP_ERROR_OWRITE_FAILURE;
+    }
+
+    auto size = entry.getSize();
+    if (range != dataranges.end() &&
+        engine->buffersize(size, chunksize) <= MAXINFLATEBUFFER)
+    {
+        auto buffer = pagebuffer(engine->buffersize(size, chunksize));
+        uLong crc = crc32(0, Z_NULL, 0);
+        bool written = true;
+        auto chunks = [&](const std::uint8_t *data, std::uint64_t data_size) {
+            crc = crc32_z(crc, data, data_size);
+            written = writechunks(data, data_size, output, chunksize);
+            return written;
+        };
+        bool inflated = engine->inflate(mapping + range->second.offset,
+                                        range->second.compressedsize,
+                                        size,
+                                        buffer.get(),
+                                        engine->buffersize(size, chunksize),
+                                        chunks);
+        if (!written) {
+            return LIBZIPPP_ERROR_OWRITE_FAILURE;
+        }
+        if (!inflated || crc != range->second.crc) {
+            return LIBZIPPP_ERROR_FREAD_FAILURE;
+        }
+        return LIBZIPPP_OK;
+    }
+
+    return archive->readEntry(archive->getEntry(entry.getIndex()),
+                              output,
+                              libzippp::ZipArchive::Current,
+                              chunksize);
+}
+
+std::uint32_t
+zipsource::crc(const wheelentry &entry) const
+{
+    return archive->getEntry(entry.getIndex()).getCRC();
+}
+
+bool
+zipsource::entryrange(const wheelentry &entry,
+                      boost::filesystem::path &rangefile,
+                      std::uint64_t &offset) const
+{
+    auto range = dataranges.find(entry.getName());
+    if (range == dataranges.end() || range->second.method != METHODSTORED) {
+        return false;
+    }
+    rangefile = filepath;
+    offset = range->second.offset;
+
+    return true;
+}
+
+// entries whose data wasn't found are placed after all others
+std::uint64_t
+zipsource::entryoffset(const wheelentry &entry) const
+{
+    auto range = dataranges.find(entry.getName());
+    if (range == dataranges.end()) {
+        return std::numeric_limits<std::uint64_t>::max();
+    }
+
+    return range->second.offset;
+}
+
+// the pages of the data of the entry are read ahead into the page cache,
+// which also serves the entries that are copied from their range
+void
+zipsource::willneed(const wheelentry &entry) const
+{
+    auto range = dataranges.find(entry.getName());
+    if (range == dataranges.end() || range->second.compressedsize == 0) {
+        return;
+    }
+
+    std::uint64_t pagesize = sysconf(_SC_PAGESIZE);
+    std::uint64_t start = range->second.offset;
+    start -= start % pagesize;
+    posix_madvise((void *)(mapping + start),
+                  range->second.offset + range->second.compressedsize - start,
+                  POSIX_MADV_WILLNEED);
+}
+
+// The pages of the mapping that only hold data of the entry are dropped
+// from it and from the page cache, so that a large entry doesn't push out
+// the cache of the files it is installed next to. posix_madvise can't be
+// used since glibc ignores POSIX_MADV_DONTNEED. A wheel installed to
+// several targets reads the entry from disk again for the next one.
+void
+zipsource::dontneed(const wheelentry &entry) const
+{
+    auto range = dataranges.find(entry.getName());
+    if (range == dataranges.end()) {
+        return;
+    }
+
+    std::uint64_t pagesize = sysconf(_SC_PAGESIZE);
+    std::uint64_t start =
+      (range->second.offset + pagesize - 1) / pagesize * pagesize;
+    std::uint64_t end = range->second.offset + range->second.compressedsize;
+    end -= end % pagesize;
+    if (end <= start) {
+        return;
+    }
+#if defined(__linux__)
+    madvise((void *)(mapping + start), end - start, MADV_DONTNEED);
+#endif
+#if defined(POSIX_FADV_DONTNEED)
+    int fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+#endif
+}
+
+// The entries are the regular files under the directory, sorted by name.
+// Symbolic links are not followed since they could point outside of the
+// wheel, a directory with one is not a wheel crosswrench installs.
+dirsource::dirsource(boost::filesystem::path _dir)
+  : dir{ _dir }
+{
+    std::vector<boost::filesystem::path> files;
+    for (auto &entry : boost::filesystem::recursive_directory_iterator(dir)) {
+        auto status = entry.symlink_status();
+        if (boost::filesystem::is_directory(status)) {
+            continue;
+        }
+        auto name = entry.path().lexically_relative(dir).generic_string();
+        if (!boost::filesystem::is_regular_file(status)) {
+            throw std::string("crosswrench install: ") + name +
+              std::string(" in ") + dir.string() +
+              std::string(" is not a regular file");
+        }
+        files.push_back(entry.path());
+    }
+    std::sort(files.begin(), files.end());
+
+    std::vector<wheelentry> entries;
+    for (auto &file : files) {
+        struct stat sb;
+        if (stat(file.c_str(), &sb) != 0) {
+            throw std::string("crosswrench install: could not stat ") +
+              file.string();
+        }
+        entries.emplace_back(this,
+                             file.lexically_relative(dir).generic_string(),
+                             sb.st_size,
+                             false,
+                             (sb.st_mode & 0111) != 0,
+                             entries.size());
+    }
+    setentries(std::move(entries));
+}
+
+int
+dirsource::readEntry(const wheelentry &entry,
+                     std::function<bool(const void *, libzippp_uint64)> output,
+                     libzippp_uint64 chunksize) const
+{
+    return readrange(
+      dir / entry.getName(), 0, entry.getSize(), output, chunksize);
+}
+
+std::uint32_t
+dirsource::crc(const wheelentry &entry) const
+{
+    std::uint32_t value = crc32(0, Z_NULL, 0);
+    auto crcfile = [&](const std::uint8_t *data, std::size_t data_size) {
+        // crc32 takes the length as an unsigned int
+        while (data_size != 0) {
+            auto len = std::min<std::size_t>(data_size, 1 << 30);
+            value = crc32(value, data, len);
+            data += len;
+            data_size -= len;
+        }
+    };
+    if (!readfile(dir / entry.getName(), crcfile)) {
+        throw std::string("crosswrench install: could not read ") +
+          (dir / entry.getName()).string();
+    }
+
+    return value;
+}
+
+bool
+dirsource::entryrange(const wheelentry &entry,
+                      boost::filesystem::path &rangefile,
+                      std::uint64_t &offset) const
+{
+    rangefile = dir / entry.getName();
+    offset = 0;
+
+    return true;
+}
+
+void
+dirsource::willneed(const wheelentry &entry) const
+{
+#if defined(POSIX_FADV_WILLNEED)
+    int fd = ::open((dir / entry.getName()).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+#else
+    (void)entry;
+#endif
+}
+
+} // namespace crosswrench
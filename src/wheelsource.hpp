@@ -0,0 +1,144 @@
+#if !defined(_SRC_WHEELSOURCE_HPP_)
+#define _SRC_WHEELSOURCE_HPP_
+
+#include "inflater.hpp"
+
+#include <boost/filesystem.hpp>
+#include <libzippp.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace crosswrench {
+
+class wheelsource;
+
+// an entry of a wheel, named like the parts of libzippp::ZipEntry that
+// crosswrench uses so it reads the same for zip files and directories
+class wheelentry
+{
+  public:
+    wheelentry(const wheelsource *,
+               std::string,
+               std::uint64_t,
+               bool directory,
+               bool exec,
+               libzippp_uint64 index);
+    std::string getName() const;
+    bool isDirectory() const;
+    std::uint64_t getSize() const;
+    std::uint32_t getCRC() const;
+    std::string readAsText() const;
+    libzippp_uint64 getIndex() const;
+    bool isexec() const;
+
+  private:
+    const wheelsource *source;
+    std::string name;
+    std::uint64_t size;
+    bool directory;
+    bool exec;
+    libzippp_uint64 index;
+};
+
+// where the entries of a wheel are read from, a zip file or a directory
+// with an unpacked wheel, the source lists its entries once with setentries
+class wheelsource
+{
+  public:
+    virtual ~wheelsource() = default;
+    std::vector<wheelentry> getEntries() const;
+    bool hasEntry(const std::string &) const;
+    wheelentry getEntry(const std::string &) const;
+    virtual int readEntry(
+      const wheelentry &,
+      std::function<bool(const void *, libzippp_uint64)>,
+      libzippp_uint64 chunksize = LIBZIPPP_DEFAULT_CHUNK_SIZE) const = 0;
+    virtual std::uint32_t crc(const wheelentry &) const = 0;
+    virtual bool entryrange(const wheelentry &,
+                            boost::filesystem::path &,
+                            std::uint64_t &) const;
+    std::vector<wheelentry> inarchiveorder() const;
+    virtual std::uint64_t entryoffset(const wheelentry &) const;
+    virtual void willneed(const wheelentry &) const;
+    virtual void dontneed(const wheelentry &) const;
+
+  protected:
+    void setentries(std::vector<wheelentry>);
+
+  private:
+    std::vector<wheelentry> entries;
+    std::map<std::string, std::size_t> names;
+};
+
+// The zip file is mapped into memory and its central directory and local
+// headers are read to find where the data of each entry is. Entries stored
+// without compression are copied from their range in the zip file when they
+// are installed and deflated entries are inflated from the mapping, libzippp
+// reads the entries when this is not possible.
+class zipsource : public wheelsource
+{
+  public:
+    zipsource(std::string);
+    ~zipsource();
+    zipsource(const zipsource &) = delete;
+    zipsource &operator=(const zipsource &) = delete;
+    bool open();
+    int readEntry(const wheelentry &,
+                  std::function<bool(const void *, libzippp_uint64)>,
+                  libzippp_uint64 chunksize) const override;
+    std::uint32_t crc(const wheelentry &) const override;
+    bool entryrange(const wheelentry &,
+                    boost::filesystem::path &,
+                    std::uint64_t &) const override;
+    std::uint64_t entryoffset(const wheelentry &) const override;
+    void willneed(const wheelentry &) const override;
+    void dontneed(const wheelentry &) const override;
+
+  private:
+    struct datarange
+    {
+        std::uint16_t method;
+        std::uint32_t crc;
+        std::uint64_t offset;
+        std::uint64_t compressedsize;
+    };
+
+    void mapfile();
+    void findranges();
+
+    boost::filesystem::path filepath;
+    std::unique_ptr<libzippp::ZipArchive> archive;
+    std::unique_ptr<inflater> engine;
+    const std::uint8_t *mapping;
+    std::uint64_t mappingsize;
+    std::map<std::string, datarange> dataranges;
+};
+
+// the files of the directory are the entries, all of them are copied
+// instead of inflated when they are installed
+class dirsource : public wheelsource
+{
+  public:
+    dirsource(boost::filesystem::path);
+    int readEntry(const wheelentry &,
+                  std::function<bool(const void *, libzippp_uint64)>,
+                  libzippp_uint64 chunksize) const override;
+    std::uint32_t crc(const wheelentry &) const override;
+    bool entryrange(const wheelentry &,
+                    boost::filesystem::path &,
+                    std::uint64_t &) const override;
+    void willneed(const wheelentry &) const override;
+
+  private:
+    boost::filesystem::path dir;
+};
+
+} // namespace crosswrench
+
+#endif
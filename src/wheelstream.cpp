@@ -0,0 +1,567 @@
+/*
+Copyright (c) 2022 Niclas Rosenvik
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "wheelstream.hpp"
+
+#include "functions.hpp"
+#include "hashlib2botan.hpp"
+#include "outfile.hpp"
+
+#include <boost/filesystem.hpp>
+#include <botan/base64.h>
+#include <botan/hash.h>
+#include <pystring.h>
+
+#include <zlib.h>
+
+#include <sys/types.h>
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <istream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace crosswrench {
+
+namespace {
+const std::uint32_t LOCALSIG = 0x04034b50;
+const std::uint32_t DESCRIPTORSIG = 0x08074b50;
+const std::uint32_t CENTRALSIG = 0x02014b50;
+const std::uint32_t ZIP64ENDSIG = 0x06064b50;
+const std::uint32_t ZIP64LOCATORSIG = 0x07064b50;
+const std::uint32_t ENDSIG = 0x06054b50;
+const char DESCRIPTORBYTES[4] = { 'P', 'K', 7, 8 };
+const std::uint16_t ZIP64EXTRAID = 0x0001;
+const std::uint16_t FLAGENCRYPTED = 0x0001;
+const std::uint16_t FLAGDESCRIPTOR = 0x0008;
+const std::uint16_t METHODSTORED = 0;
+const std::uint16_t METHODDEFLATED = 8;
+const std::uint16_t OPSYSUNIX = 3;
+const std::uint64_t ZIP32MAX = 0xffffffff;
+const std::size_t STREAMBUFFERSIZE = 64 * 1024;
+const mode_t STAGEFILEMODE = 0644;
+const mode_t STAGEEXECMODE = 0755;
+
+// the hash type that RECORD is written with by bdist_wheel and most other
+// wheel builders, entries in a RECORD with another hash type are read again
+// from the staging directory when it is verified
+const char *const STREAMHASHTYPE = "sha256";
+
+std::string
+streamerror(std::string name, std::string what)
+{
+    return "crosswrench install: " + name + " in the wheel on stdin " + what;
+}
+} // namespace
+
+// the staging directory is created in parent, on the filesystem the wheel
+// is installed on so that its files can be copied by the kernel
+wheelstream::wheelstream(std::istream &_input, boost::filesystem::path parent)
+  : input{ _input }
+  , hashtype{ STREAMHASHTYPE }
+  , stagedir{ parent / boost::filesystem::unique_path(
+                         ".crosswrench-stream-%%%%-%%%%-%%%%") }
+  , buffer(STREAMBUFFERSIZE)
+  , bufferpos{ 0 }
+  , bufferlen{ 0 }
+  , streamoffset{ 0 }
+{
+    boost::filesystem::create_directories(stagedir);
+}
+
+wheelstream::~wheelstream()
+{
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(stagedir, ec);
+}
+
+boost::filesystem::path
+wheelstream::stagepath()
+{
+    return stagedir;
+}
+
+// the same layout as a row in record, hash type, hash and size
+std::map<std::string, std::array<std::string, 3>>
+wheelstream::hashes()
+{
+    std::map<std::string, std::array<std::string, 3>> result;
+    for (auto &entry : localentries) {
+        result[entry.first] = { hashtype,
+                                entry.second.hash,
+                                std::to_string(entry.second.size) };
+    }
+    return result;
+}
+
+// Local headers are read in the order they arrive and their entries are
+// staged, the central directory at the end of the wheel is then checked
+// against what the local headers and the data descriptors said. Nothing is
+// installed from the staging directory until this and the check against
+// RECORD have passed.
+void
+wheelstream::read()
+{
+    for (;;) {
+        auto sig = read32();
+        if (sig == LOCALSIG) {
+            readlocalentry();
+        }
+        else if (sig == CENTRALSIG) {
+            readcentralentry();
+        }
+        else if (sig == ZIP64ENDSIG) {
+            skipbytes(read64());
+        }
+        else if (sig == ZIP64LOCATORSIG) {
+            skipbytes(16);
+        }
+        else if (sig == ENDSIG) {
+            skipbytes(16);
+            skipbytes(read16());
+            break;
+        }
+        else {
+            throw std::string("crosswrench install: the wheel on stdin is "
+                              "not a zip file or is corrupt");
+        }
+    }
+
+    while (fill() != 0) {
+        consume(bufferlen - bufferpos);
+    }
+
+    if (localentries.size() != centralentries.size()) {
+        throw std::string("crosswrench install: the central directory of "
+                          "the wheel on stdin does not list all entries");
+    }
+    for (auto &central : centralentries) {
+        auto local = localentries.find(central.first);
+        if (local == localentries.end() ||
+            local->second.crc != central.second.crc ||
+            local->second.compressedsize != central.second.compressedsize ||
+            local->second.size != central.second.size ||
+            local->second.offset != central.second.offset)
+        {
+            throw streamerror(central.first,
+                              "differs between its local header and the "
+                              "central directory");
+        }
+
+        // the mode is only in the central directory
+        auto filepath = stagefile(central.first);
+        if (central.second.exec && !pystring::endswith(central.first, "/") &&
+            chmod(filepath.c_str(), STAGEEXECMODE) != 0)
+        {
+            throw std::string("crosswrench install: could not set the mode "
+                              "of ") +
+              filepath.string();
+        }
+    }
+}
+
+std::size_t
+wheelstream::fill()
+{
+    if (bufferpos == bufferlen) {
+        input.read(buffer.data(), buffer.size());
+        bufferlen = input.gcount();
+        bufferpos = 0;
+    }
+    return bufferlen - bufferpos;
+}
+
+// makes at least len bytes available at bufferpos, false if the stream
+// ends before that
+bool
+wheelstream::lookahead(std::size_t len)
+{
+    if (bufferlen - bufferpos >= len) {
+        return true;
+    }
+
+    std::memmove(
+      buffer.data(), buffer.data() + bufferpos, bufferlen - bufferpos);
+    bufferlen -= bufferpos;
+    bufferpos = 0;
+    while (bufferlen < len && input) {
+        input.read(buffer.data() + bufferlen, buffer.size() - bufferlen);
+        bufferlen += input.gcount();
+    }
+
+    return bufferlen >= len;
+}
+
+void
+wheelstream::consume(std::size_t len)
+{
+    bufferpos += len;
+    streamoffset += len;
+}
+
+void
+wheelstream::readbytes(void *data, std::size_t len)
+{
+    auto dest = (char *)data;
+    while (len != 0) {
+        auto avail = fill();
+        if (avail == 0) {
+            throw std::string("crosswrench install: the wheel on stdin "
+                              "ended early");
+        }
+        auto take = std::min(avail, len);
+        std::memcpy(dest, buffer.data() + bufferpos, take);
+        consume(take);
+        dest += take;
+        len -= take;
+    }
+}
+
+void
+wheelstream::skipbytes(std::uint64_t len)
+{
+    while (len != 0) {
+        auto avail = fill();
+        if (avail == 0) {
+            throw std::string("crosswrench install: the wheel on stdin "
+                              "ended early");
+        }
+        auto take = (std::size_t)std::min<std::uint64_t>(avail, len);
+        consume(take);
+        len -= take;
+    }
+}
+
+std::uint16_t
+wheelstream::read16()
+{
+    std::string data(2, '\0');
+    readbytes(&data[0], data.size());
+    return getle(data, 0, data.size());
+}
+
+std::uint32_t
+wheelstream::read32()
+{
+    std::string data(4, '\0');
+    readbytes(&data[0], data.size());
+    return getle(data, 0, data.size());
+}
+
+std::uint64_t
+wheelstream::read64()
+{
+    std::string data(8, '\0');
+    readbytes(&data[0], data.size());
+    return getle(data, 0, data.size());
+}
+
+// a little endian value in the buffer that has not been consumed
+std::uint64_t
+wheelstream::bufferle(std::size_t pos, std::size_t len)
+{
+    return getle(std::string(buffer.data() + pos, len), 0, len);
+}
+
+// the values that don't fit in the header are in the zip64 extra field in
+// the order uncompressed size, compressed size and local header offset
+void
+wheelstream::readzip64extra(const std::string &extra,
+                            std::uint64_t &size,
+                            std::uint64_t &compressedsize,
+                            std::uint64_t &localoffset,
+                            bool &zip64)
+{
+    std::size_t pos = 0;
+    while (pos + 4 <= extra.size()) {
+        auto id = getle(extra, pos, 2);
+        auto len = getle(extra, pos + 2, 2);
+        pos += 4;
+        if (pos + len > extra.size()) {
+            break;
+        }
+        if (id == ZIP64EXTRAID) {
+            auto field = pos;
+            if (size == ZIP32MAX && field + 8 <= pos + len) {
+                size = getle(extra, field, 8);
+                field += 8;
+            }
+            if (compressedsize == ZIP32MAX && field + 8 <= pos + len) {
+                compressedsize = getle(extra, field, 8);
+                field += 8;
+            }
+            if (localoffset == ZIP32MAX && field + 8 <= pos + len) {
+                localoffset = getle(extra, field, 8);
+            }
+            zip64 = true;
+        }
+        pos += len;
+    }
+}
+
+// the data is hashed and written to the staging directory as it is
+// inflated, the stream is not read any further than the entry
+void
+wheelstream::readlocalentry()
+{
+    // the signature was already read
+    std::uint64_t localoffset = streamoffset - 4;
+    read16(); // version needed to extract
+    auto flags = read16();
+    auto method = read16();
+    skipbytes(4); // modification time and date
+    std::uint32_t crc = read32();
+    std::uint64_t compressedsize = read32();
+    std::uint64_t size = read32();
+    std::string name(read16(), '\0');
+    std::string extra(read16(), '\0');
+    readbytes(&name[0], name.size());
+    readbytes(&extra[0], extra.size());
+
+    bool zip64 = false;
+    std::uint64_t nooffset = 0;
+    readzip64extra(extra, size, compressedsize, nooffset, zip64);
+
+    if (flags & FLAGENCRYPTED) {
+        throw streamerror(name, "is encrypted");
+    }
+    if (method != METHODSTORED && method != METHODDEFLATED) {
+        throw streamerror(name, "is compressed with an unsupported method");
+    }
+    if (localentries.count(name) != 0) {
+        throw streamerror(name, "is in the wheel more than once");
+    }
+
+    bool descriptor = (flags & FLAGDESCRIPTOR) != 0;
+    bool directory = pystring::endswith(name, "/");
+    auto filepath = stagefile(name);
+    outfile output_p;
+    if (directory) {
+        boost::filesystem::create_directories(filepath);
+    }
+    else {
+        boost::filesystem::create_directories(filepath.parent_path());
+        if (!output_p.open(filepath, STAGEFILEMODE, descriptor ? 0 : size)) {
+            throw std::string("crosswrench install: could not open ") +
+              filepath.string();
+        }
+    }
+
+    auto hasher = Botan::HashFunction::create(h2b.hashname(hashtype));
+    std::uint32_t datacrc = crc32(0, Z_NULL, 0);
+    std::uint64_t consumed = 0;
+    std::uint64_t produced = 0;
+    bool written = true;
+    auto output = [&](const std::uint8_t *data, std::size_t data_size) {
+        hasher->update(data, data_size);
+        datacrc = crc32(datacrc, data, data_size);
+        produced += data_size;
+        if (!directory) {
+            written = written && output_p.write(data, data_size);
+        }
+    };
+
+    if (method == METHODSTORED && descriptor) {
+        readstored(name, zip64, datacrc, produced, output);
+        consumed = produced;
+    }
+    else if (method == METHODSTORED) {
+        while (consumed != compressedsize) {
+            auto avail = fill();
+            if (avail == 0) {
+                throw streamerror(name, "ended early");
+            }
+            auto take = (std::size_t)std::min<std::uint64_t>(
+              avail, compressedsize - consumed);
+            output((const std::uint8_t *)buffer.data() + bufferpos, take);
+            consume(take);
+            consumed += take;
+        }
+    }
+    else {
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+            throw streamerror(name, "could not be inflated");
+        }
+        std::vector<std::uint8_t> out(STREAMBUFFERSIZE);
+        int ret = Z_OK;
+        while (ret != Z_STREAM_END) {
+            auto avail = fill();
+            if (avail == 0) {
+                inflateEnd(&zs);
+                throw streamerror(name, "ended early");
+            }
+            zs.next_in = (Bytef *)buffer.data() + bufferpos;
+            zs.avail_in = avail;
+            do {
+                zs.next_out = out.data();
+                zs.avail_out = out.size();
+                ret = inflate(&zs, Z_NO_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                    inflateEnd(&zs);
+                    throw streamerror(name, "could not be inflated");
+                }
+                output(out.data(), out.size() - zs.avail_out);
+            } while (ret == Z_OK && zs.avail_out == 0);
+            auto used = avail - zs.avail_in;
+            consume(used);
+            consumed += used;
+        }
+        inflateEnd(&zs);
+    }
+
+    if (descriptor) {
+        auto first = read32();
+        crc = first == DESCRIPTORSIG ? read32() : first;
+        compressedsize = zip64 ? read64() : read32();
+        size = zip64 ? read64() : read32();
+    }
+
+    if (!written || (!directory && !output_p.close())) {
+        throw std::string("crosswrench install: could not write to file ") +
+          filepath.string();
+    }
+    if (datacrc != crc || consumed != compressedsize || produced != size) {
+        throw streamerror(name, "is corrupt");
+    }
+
+    localentries[name] = { crc,
+                           compressedsize,
+                           size,
+                           localoffset,
+                           false,
+                           base64urlsafenopad(
+                             Botan::base64_encode(hasher->final())) };
+}
+
+// Stored data has no end marker of its own when its size is in a data
+// descriptor after it. The data ends at the first descriptor signature
+// that is followed by the crc and size of the bytes before it and then by
+// the signature of the next header. datacrc and produced are kept up to
+// date by output so every candidate is checked without going back over
+// the data.
+void
+wheelstream::readstored(
+  const std::string &name,
+  bool zip64,
+  const std::uint32_t &datacrc,
+  const std::uint64_t &produced,
+  std::function<void(const std::uint8_t *, std::size_t)> output)
+{
+    std::size_t descriptorsize = zip64 ? 24 : 16;
+    std::size_t needed = descriptorsize + 4;
+    for (;;) {
+        if (!lookahead(needed)) {
+            throw streamerror(name, "ended early");
+        }
+
+        auto data = (const std::uint8_t *)buffer.data();
+        std::size_t last = bufferlen - needed;
+        std::size_t pos = bufferpos;
+        while (pos <= last) {
+            auto found = (const std::uint8_t *)std::memchr(
+              data + pos, DESCRIPTORBYTES[0], last - pos + 1);
+            if (found == nullptr) {
+                pos = last + 1;
+                break;
+            }
+            pos = found - data;
+            if (std::memcmp(found, DESCRIPTORBYTES, 4) == 0) {
+                output(data + bufferpos, pos - bufferpos);
+                consume(pos - bufferpos);
+                auto next = bufferle(pos + descriptorsize, 4);
+                if (bufferle(pos + 4, 4) == datacrc &&
+                    bufferle(pos + 8, zip64 ? 8 : 4) == produced &&
+                    bufferle(pos + (zip64 ? 16 : 12), zip64 ? 8 : 4) ==
+                      produced &&
+                    (next == LOCALSIG || next == CENTRALSIG))
+                {
+                    return;
+                }
+            }
+            pos++;
+        }
+        output(data + bufferpos, pos - bufferpos);
+        consume(pos - bufferpos);
+    }
+}
+
+void
+wheelstream::readcentralentry()
+{
+    auto madeby = read16();
+    read16();     // version needed to extract
+    read16();     // flags
+    read16();     // compression method
+    skipbytes(4); // modification time and date
+    std::uint32_t crc = read32();
+    std::uint64_t compressedsize = read32();
+    std::uint64_t size = read32();
+    std::string name(read16(), '\0');
+    std::string extra(read16(), '\0');
+    std::uint64_t commentlen = read16();
+    skipbytes(4); // disk and internal attributes
+    std::uint32_t attributes = read32();
+    std::uint64_t localoffset = read32();
+    readbytes(&name[0], name.size());
+    readbytes(&extra[0], extra.size());
+    skipbytes(commentlen);
+
+    bool zip64 = false;
+    readzip64extra(extra, size, compressedsize, localoffset, zip64);
+
+    // the execute bits are used like they are for a zip file
+    bool exec = (madeby >> 8) == OPSYSUNIX && ((attributes >> 16) & 0111) != 0;
+
+    if (centralentries.count(name) != 0) {
+        throw streamerror(name, "is in the central directory more than once");
+    }
+    centralentries[name] = { crc, compressedsize, size, localoffset, exec, "" };
+}
+
+// the path below the staging directory an entry is written to, a name that
+// would end up outside of it is refused before anything is written
+boost::filesystem::path
+wheelstream::stagefile(const std::string &name)
+{
+    std::vector<std::string> parts;
+    pystring::split(name, parts, "/");
+    std::string dotdot{ ".." };
+    if (name.empty() || pystring::startswith(name, "/") ||
+        name.find('\0') != std::string::npos || strvec_contains(parts, dotdot))
+    {
+        throw streamerror(name, "has a path that can not be installed");
+    }
+
+    return stagedir / name;
+}
+
+} // namespace crosswrench
@@ -0,0 +1,84 @@
+#if !defined(_SRC_WHEELSTREAM_HPP_)
+#define _SRC_WHEELSTREAM_HPP_
+
+#include "hashlib2botan.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace crosswrench {
+
+// Reads a wheel from a stream that can't seek. Every entry is inflated,
+// hashed and written below a staging directory as its local header and
+// data arrive, so the wheel is unpacked when the stream ends. The central
+// directory is then checked against what was read and the staging
+// directory is installed like an unpacked wheel.
+class wheelstream
+{
+  public:
+    wheelstream() = delete;
+    wheelstream(std::istream &, boost::filesystem::path);
+    ~wheelstream();
+    wheelstream(const wheelstream &) = delete;
+    wheelstream &operator=(const wheelstream &) = delete;
+    void read();
+    boost::filesystem::path stagepath();
+    std::map<std::string, std::array<std::string, 3>> hashes();
+
+  private:
+    struct streamentry
+    {
+        std::uint32_t crc;
+        std::uint64_t compressedsize;
+        std::uint64_t size;
+        std::uint64_t offset;
+        bool exec;
+        std::string hash;
+    };
+
+    std::size_t fill();
+    bool lookahead(std::size_t);
+    void consume(std::size_t);
+    void readbytes(void *, std::size_t);
+    void skipbytes(std::uint64_t);
+    std::uint16_t read16();
+    std::uint32_t read32();
+    std::uint64_t read64();
+    std::uint64_t bufferle(std::size_t, std::size_t);
+    void readlocalentry();
+    void readstored(const std::string &,
+                    bool,
+                    const std::uint32_t &,
+                    const std::uint64_t &,
+                    std::function<void(const std::uint8_t *, std::size_t)>);
+    void readcentralentry();
+    void readzip64extra(const std::string &,
+                        std::uint64_t &,
+                        std::uint64_t &,
+                        std::uint64_t &,
+                        bool &);
+    boost::filesystem::path stagefile(const std::string &);
+
+    std::istream &input;
+    std::string hashtype;
+    hashlib2botan h2b;
+    boost::filesystem::path stagedir;
+    std::vector<char> buffer;
+    std::size_t bufferpos;
+    std::size_t bufferlen;
+    std::uint64_t streamoffset;
+    std::map<std::string, streamentry> localentries;
+    std::map<std::string, streamentry> centralentries;
+};
+
+} // namespace crosswrench
+
+#endif